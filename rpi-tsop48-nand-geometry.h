@@ -0,0 +1,21 @@
+/*
+    Page geometry shared by rpi-tsop48-nand and rpi-tsop48-nand-tool.
+
+    Copyright (C) 2016  littlebalup
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef RPI_TSOP48_NAND_GEOMETRY_H
+#define RPI_TSOP48_NAND_GEOMETRY_H
+
+#define PAGE_SIZE 2112 // (2K + 64)Byte, a page in the read_full layout
+#define DATA_SIZE 2048 // main area, a page in the read_data layout
+#define SPARE_SIZE (PAGE_SIZE - DATA_SIZE)
+#define BLOCK_SIZE 135168 // (2K + 64)Byte
+#define PAGES_PER_BLOCK 64
+
+#endif
@@ -0,0 +1,290 @@
+/*
+    rpi-tsop48-nand-tool : offline companion to rpi-tsop48-nand
+
+    Converts and cuts dump images without touching the GPIO: strips the
+    spare area off read_full dumps, puts it back, and extracts block
+    ranges.
+
+    Copyright (C) 2016  littlebalup
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64 // multi-GB images on a 32 bit Pi
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rpi-tsop48-nand-geometry.h"
+
+/*
+ * Images are mapped a window at a time, so a 4 GB dump fits a 32 bit
+ * address space. A window is a whole number of blocks: 64 pages of 2112
+ * bytes is 33 * 4096, so both layouts start every block on a page
+ * boundary and the mmap() offsets stay aligned.
+ */
+#define WINDOW_BLOCKS	256
+
+typedef uint64_t vec128 __attribute__((vector_size(16)));
+
+enum { STRIP, INSERT, EXTRACT };
+
+struct image {
+	const char *path;
+	int fd;
+	size_t page;                // bytes per page in this file
+	unsigned char *map;
+	size_t len;
+};
+
+/*
+ * Copy kernels. Every page, main area and spare area starts on a 16 byte
+ * boundary (2112, 2048 and 64 are multiples of 16 and windows are page
+ * aligned), so the loops move aligned 16 byte vectors, four at a time;
+ * GCC turns them into NEON or SSE loads and stores.
+ */
+static inline void copy_vec(unsigned char *dst, const unsigned char *src, size_t n)
+{
+	vec128 *d = (vec128 *)dst;
+	const vec128 *s = (const vec128 *)src;
+
+	for (n /= 4 * sizeof(vec128); n; n--, d += 4, s += 4) {
+		vec128 a = s[0], b = s[1], c = s[2], e = s[3];
+		d[0] = a;
+		d[1] = b;
+		d[2] = c;
+		d[3] = e;
+	}
+}
+
+static inline void fill_vec(unsigned char *dst, size_t n)
+{
+	vec128 *d = (vec128 *)dst, ff = { ~0ULL, ~0ULL };
+
+	for (n /= 4 * sizeof(vec128); n; n--, d += 4) {
+		d[0] = ff;
+		d[1] = ff;
+		d[2] = ff;
+		d[3] = ff;
+	}
+}
+
+static int image_open(image *im, const char *path, size_t page, int output, long pages)
+{
+	struct stat st;
+
+	im->path = path;
+	im->page = page;
+	im->map = NULL;
+	im->len = 0;
+	im->fd = output ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+	if (im->fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (output) {
+		if (ftruncate(im->fd, (off_t)pages * page) < 0) {
+			perror(path);
+			return -1;
+		}
+		return 0;
+	}
+	if (fstat(im->fd, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (st.st_size % page)
+		printf("%s: %lld bytes are not a whole number of %zu byte pages, the rest is ignored\n",
+			path, (long long)st.st_size, page);
+	return st.st_size / page;
+}
+
+/* maps pages [first, first + n) of an image */
+static int image_map(image *im, long first, long n, int output)
+{
+	if (im->map != NULL)
+		munmap(im->map, im->len);
+	im->len = n * im->page;
+	im->map = (unsigned char *)mmap(NULL, im->len, output ? PROT_READ | PROT_WRITE : PROT_READ,
+		MAP_SHARED, im->fd, (off_t)first * im->page);
+	if (im->map == MAP_FAILED) {
+		im->map = NULL;
+		perror(im->path);
+		return -1;
+	}
+	madvise(im->map, im->len, MADV_SEQUENTIAL);
+	return 0;
+}
+
+static void image_close(image *im)
+{
+	if (im->map != NULL)
+		munmap(im->map, im->len);
+	close(im->fd);
+}
+
+/*
+ * Runs one conversion over pages [first, first + pages) of in, writing
+ * output page 0 onwards.
+ *  STRIP    raw -> main, the spare areas go to oob if given
+ *  INSERT   main -> raw, the spare areas come from oob, or FFh
+ *  EXTRACT  same layout, a page range
+ */
+static int convert(int op, image *in, image *out, image *oob, long first, long pages)
+{
+	long done, n, i;
+	const unsigned char *src;
+	unsigned char *dst;
+	struct timespec t0, t1;
+	double s;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (done = 0; done < pages; done += n) {
+		n = pages - done < WINDOW_BLOCKS * PAGES_PER_BLOCK ? pages - done : WINDOW_BLOCKS * PAGES_PER_BLOCK;
+		if (image_map(in, first + done, n, 0) < 0 || image_map(out, done, n, 1) < 0)
+			return -1;
+		if (oob != NULL && image_map(oob, done, n, op == STRIP) < 0)
+			return -1;
+		for (i = 0; i < n; i++) {
+			src = in->map + i * in->page;
+			dst = out->map + i * out->page;
+			switch (op) {
+			case STRIP:
+				copy_vec(dst, src, DATA_SIZE);
+				if (oob != NULL)
+					copy_vec(oob->map + i * SPARE_SIZE, src + DATA_SIZE, SPARE_SIZE);
+				break;
+			case INSERT:
+				copy_vec(dst, src, DATA_SIZE);
+				if (oob != NULL)
+					copy_vec(dst + DATA_SIZE, oob->map + i * SPARE_SIZE, SPARE_SIZE);
+				else
+					fill_vec(dst + DATA_SIZE, SPARE_SIZE);
+				break;
+			case EXTRACT:
+				copy_vec(dst, src, in->page);
+				break;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%ld pages, %zu -> %zu bytes per page, %.2f s (%.0f MB/s)\n",
+		pages, in->page, out->page, s, s > 0 ? pages * in->page / s / 1e6 : 0);
+	return 0;
+}
+
+/* a whole non-negative number (decimal, or hex with 0x), -1 for anything else */
+static long arg_number(const char *arg)
+{
+	char *end;
+	long v = strtol(arg, &end, 0);
+
+	return end != arg && *end == 0 && v >= 0 && v <= INT_MAX ? v : -1;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] <command> ...\n\n" \
+	    "Commands:\n" \
+	    " strip <raw> <main> [<oob>]           : read_full dump -> read_data layout, the\n" \
+	    "                                        %d byte spare areas go to <oob> if given\n" \
+	    " insert <main> <raw> [<oob>]          : read_data layout -> read_full dump, spare\n" \
+	    "                                        areas from <oob>, or FFh (ready for write_full)\n" \
+	    " extract [--main] <image> <block #> <# of blocks> <output>\n" \
+	    "                                      : copy a block range\n\n" \
+	    "Options (before or after the command):\n" \
+	    " --main                               : extract works on a read_data image\n\n" \
+	    "Notes:\n" \
+	    " This program assumes PAGE_SIZE == %d, %d pages per block\n",
+	    name, SPARE_SIZE, PAGE_SIZE, PAGES_PER_BLOCK);
+}
+
+int main(int argc, char **argv)
+{
+	image in, out, oob;
+	long pages, oob_pages, first, blocks;
+	int main_layout = 0, ret, i, n;
+
+	// options may come before or after the command
+	for (i = n = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) != 0) {
+			argv[n++] = argv[i];
+		} else if (strcmp(argv[i], "--main") == 0) {
+			main_layout = 1;
+		} else {
+			printf("unknown option '%s'\n", argv[i]);
+			return -1;
+		}
+	}
+	argc = n;
+
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "strip") == 0) {
+		if ((pages = image_open(&in, argv[2], PAGE_SIZE, 0, 0)) < 0 ||
+		    image_open(&out, argv[3], DATA_SIZE, 1, pages) < 0 ||
+		    (argc == 5 && image_open(&oob, argv[4], SPARE_SIZE, 1, pages) < 0))
+			return -1;
+		ret = convert(STRIP, &in, &out, argc == 5 ? &oob : NULL, 0, pages);
+	} else if ((argc == 4 || argc == 5) && strcmp(argv[1], "insert") == 0) {
+		if ((pages = image_open(&in, argv[2], DATA_SIZE, 0, 0)) < 0)
+			return -1;
+		if (argc == 5) {
+			if ((oob_pages = image_open(&oob, argv[4], SPARE_SIZE, 0, 0)) < 0)
+				return -1;
+			if (oob_pages < pages) {
+				printf("%s has spare areas for %ld of %ld pages\n", argv[4], oob_pages, pages);
+				return -1;
+			}
+		}
+		if (image_open(&out, argv[3], PAGE_SIZE, 1, pages) < 0)
+			return -1;
+		ret = convert(INSERT, &in, &out, argc == 5 ? &oob : NULL, 0, pages);
+	} else if (argc == 6 && strcmp(argv[1], "extract") == 0) {
+		if ((pages = image_open(&in, argv[2], main_layout ? DATA_SIZE : PAGE_SIZE, 0, 0)) < 0)
+			return -1;
+		first = arg_number(argv[3]);
+		blocks = arg_number(argv[4]);
+		if (first < 0 || blocks <= 0) {
+			printf("<block #> and <# of blocks> must be whole numbers, <# of blocks> > 0\n");
+			return -1;
+		}
+		if (first + blocks > pages / PAGES_PER_BLOCK) {
+			printf("%s holds blocks 0 to %ld\n", argv[2], pages / PAGES_PER_BLOCK - 1);
+			return -1;
+		}
+		first *= PAGES_PER_BLOCK;
+		if (image_open(&out, argv[5], in.page, 1, blocks * PAGES_PER_BLOCK) < 0)
+			return -1;
+		ret = convert(EXTRACT, &in, &out, NULL, first, blocks * PAGES_PER_BLOCK);
+	} else {
+		usage(argv[0]);
+		return -1;
+	}
+
+	image_close(&in);
+	image_close(&out);
+	if (argc == 5)
+		image_close(&oob);
+	return ret;
+}
@@ -22,6 +22,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _FILE_OFFSET_BITS 64 // multi-GB dumps on a 32 bit Pi
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +32,12 @@
 #include <time.h>
 #include <unistd.h>
 #include <math.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -39,11 +47,9 @@
 
 // #define DEBUG 1
 
-#define PAGE_SIZE 2112 // (2K + 64)Byte
-#define BLOCK_SIZE 135168 // (2K + 64)Byte
-#define MAX_WAIT_READ_BUSY	1000000
+#include "rpi-tsop48-nand-geometry.h"
 
-#define PAGES_PER_BLOCK 64
+#define MAX_WAIT_READ_BUSY	1000000
 
 /* For Raspberry B+ :*/
 #define BCM2708_PERI_BASE	0x20000000
@@ -69,10 +75,557 @@
 
 #define INLINE inline __attribute__((always_inline))
 
-int data_to_gpio_map[8] = { 23, 24, 25, 8, 7, 10, 9, 11 }; // 23 is NAND IO0, etc.
+constexpr int data_to_gpio_map[8] = { 23, 24, 25, 8, 7, 10, 9, 11 }; // 23 is NAND IO0, etc.
+
+/*
+ * Everything the data bus fast path needs, generated at compile time from
+ * data_to_gpio_map: GPSET0/GPCLR0 masks for every byte value, and the
+ * GPLEV0 -> byte gather (one 256-entry table per byte lane of the level
+ * register). Edit the map above and these follow.
+ */
+struct data_bus_tables {
+	unsigned int set[256];
+	unsigned int clr[256];
+	unsigned char in[4][256];
+	unsigned int mask;
+	unsigned int fsel_mask[4]; // function select bits of the data pins, per GPFSELn
+	unsigned int fsel_out[4];  // the same bits set to "output"
+
+	constexpr data_bus_tables() : set(), clr(), in(), mask(), fsel_mask(), fsel_out()
+	{
+		for (int i = 0; i < 8; i++) {
+			int g = data_to_gpio_map[i];
+			mask |= 1u << g;
+			fsel_mask[g / 10] |= 7u << ((g % 10) * 3);
+			fsel_out[g / 10] |= 1u << ((g % 10) * 3);
+		}
+		for (int v = 0; v < 256; v++) {
+			for (int i = 0; i < 8; i++) {
+				int g = data_to_gpio_map[i];
+				if ((v >> i) & 1)
+					set[v] |= 1u << g;
+				else
+					clr[v] |= 1u << g;
+				if ((v >> (g % 8)) & 1)
+					in[g / 8][v] |= 1 << i;
+			}
+		}
+	}
+};
+
+static constexpr data_bus_tables data_bus = data_bus_tables();
+
+static_assert(__builtin_popcount(data_bus.mask) == 8, "data_to_gpio_map must name 8 distinct GPIOs");
+static_assert(data_to_gpio_map[0] < 32 && data_to_gpio_map[1] < 32 && data_to_gpio_map[2] < 32 &&
+	data_to_gpio_map[3] < 32 && data_to_gpio_map[4] < 32 && data_to_gpio_map[5] < 32 &&
+	data_to_gpio_map[6] < 32 && data_to_gpio_map[7] < 32, "data bus must live in GPIO bank 0");
 
 volatile unsigned int *gpio;
 
+/* BCM2835 GPIO register word offsets */
+#define GPFSEL0	0
+#define GPSET0	7
+#define GPCLR0	10
+#define GPLEV0	13
+
+/*
+ * Register backends. Every primitive goes through gpio_rd()/gpio_wr() and on
+ * to GpioBackend::rd()/wr(),
+ * which is resolved at compile time: MmioBackend is a plain volatile access
+ * through the gpio mapping (/dev/mem, /dev/gpiomem or a plain memory register
+ * file for benchmarking, picked at runtime), SimBackend drives the software
+ * NAND below (build with -DNAND_SIM).
+ */
+enum { BACKEND_DEVMEM, BACKEND_GPIOMEM, BACKEND_MEM, BACKEND_SIM };
+
+struct MmioBackend {
+	static INLINE unsigned int rd(int reg) { return *(gpio + reg); }
+	static INLINE void wr(int reg, unsigned int v) { *(gpio + reg) = v; }
+};
+
+#ifdef NAND_SIM
+
+/*
+ * Simulated ONFI NAND. It watches the pin levels the primitives drive,
+ * latches command/address/data bytes on WE# rising edges, drives the data
+ * bus while RE# is low and holds R/B# low for tR/tPROG/tBERS.
+ * Commands: 90h, 00h-30h, 31h, 3Fh, 05h-E0h, 80h-10h, 80h-15h, 60h-D0h,
+ * 70h, FFh, and with --sim-planes=2 the two-plane 60h-60h-D0h, 80h-11h-81h-10h
+ * and 60h-60h-30h (output selected with 00h-05h-E0h); the plane is the
+ * lowest block address bit.
+ * A command the part would not take in its state (sim_check()), a page
+ * programmed below one already programmed in its block, or an exit inside
+ * a 31h sequence, stops the run with an error.
+ * Faults can be injected into the bus: --sim-flip=<n> flips a bit in one
+ * of every n data bytes (on average), --sim-glitch=<n> reads one of every
+ * n ID/status bytes as 00h, like a lifted clip pin, and --sim-prog-fail=<n>
+ * fails one of every n page programs without changing the page.
+ * --sim-ecc=<scheme> gives the image a valid spare area ECC at the start,
+ * for --verify=ecc; cells flipped in the image after that are bit errors.
+ * The host reads and writes the cache register; the page register holds
+ * the page the array last sensed, which is what 31h/3Fh overlap with.
+ * The array is an mmap()ed image file in the read_full layout, so a sim
+ * image and a real dump are interchangeable.
+ */
+struct sim_config {
+	const char *image;
+	long pages;                 // size of a newly created image
+	unsigned tR, tPROG, tBERS;  // microseconds
+	unsigned tRCBSY;            // 31h/3Fh/15h cache register turnaround
+	int planes;
+	unsigned flip;              // 1 in flip data bytes read gets a bit flipped
+	unsigned glitch;            // 1 in glitch ID/status bytes reads as 00h
+	unsigned prog_fail;         // 1 in prog_fail page programs fails
+	const char *ecc;            // scheme whose ECC is written into the image
+	unsigned char id[5];
+};
+
+static sim_config sim_cfg = { "nand-sim.img", 65536, 25, 200, 2000, 3, 1, 0, 0, 0, NULL, { 0xEC, 0xF1, 0x00, 0x95, 0x40 } };
+
+enum { SIM_IDLE, SIM_ID, SIM_DATA_OUT, SIM_DATA_IN, SIM_STATUS };
+
+static struct {
+	unsigned int fsel[6];
+	unsigned int lev;           // levels driven by the host
+	unsigned char *array;
+	long pages;
+	int state;
+	int cmd;                    // command the address cycles belong to
+	int naddr;
+	unsigned char addr[5];
+	int column;
+	unsigned char page_reg[PAGE_SIZE];
+	unsigned char cache_reg[PAGE_SIZE];
+	long sensed;                // row in page_reg, -1 if none for 31h to follow
+	int cache_open;             // a 31h sequence that no 3Fh has ended yet
+	signed char *top;           // per block, last page programmed this run, -1 none
+	unsigned char dout;
+	int id_index;
+	int fail;
+	int failc;                  // fail of the operation before (cache program)
+	long queued;                // first row of a two-plane operation, or -1
+	unsigned char queued_data[PAGE_SIZE];
+	long plane_row[2];          // rows in plane_reg[] after a two-plane read
+	unsigned char plane_reg[2][PAGE_SIZE];
+	long long busy_until;       // CLOCK_MONOTONIC ns, R/B#
+	long long array_until;      // array operation done (status ARDY)
+} sim;
+
+static long long sim_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static INLINE int sim_ready(void)
+{
+	return sim_now() >= sim.busy_until;
+}
+
+static void sim_busy(unsigned us)
+{
+	sim.busy_until = sim.array_until = sim_now() + us * 1000LL;
+}
+
+static void sim_sense(long row)
+{
+	sim.sensed = row;
+	if (row >= 0 && row < sim.pages)
+		memcpy(sim.page_reg, sim.array + row * PAGE_SIZE, PAGE_SIZE);
+	else
+		memset(sim.page_reg, 0xFF, PAGE_SIZE);
+}
+
+/* 31h/3Fh: waits for the running array read, then hands page_reg over */
+static void sim_cache_read(int next)
+{
+	long long t = sim_now();
+
+	if (t < sim.array_until)
+		t = sim.array_until;
+	memcpy(sim.cache_reg, sim.page_reg, PAGE_SIZE);
+	sim.busy_until = sim.array_until = t + sim_cfg.tRCBSY * 1000LL;
+	if (next) {
+		sim_sense(sim.sensed + 1);
+		sim.array_until = t + sim_cfg.tR * 1000LL;
+	} else {
+		sim.sensed = -1;
+	}
+	sim.column = 0;
+	sim.state = SIM_DATA_OUT;
+}
+
+static INLINE long sim_row(int first)
+{
+	return sim.addr[first] | (sim.addr[first + 1] << 8) | ((long)sim.addr[first + 2] << 16);
+}
+
+static INLINE int sim_plane(long row)
+{
+	return (row / PAGES_PER_BLOCK) & 1;
+}
+
+/* a two-plane operation needs one row in each plane */
+static INLINE int sim_bad_pair(long row)
+{
+	return sim.queued >= 0 && sim_plane(sim.queued) == sim_plane(row);
+}
+
+/* fault injection: one in n */
+static INLINE int sim_fault(unsigned n)
+{
+	return n && rand() % n == 0;
+}
+
+static int sim_program(long row, const unsigned char *data, int wp)
+{
+	long i;
+
+	if (!wp || row >= sim.pages)
+		return 1;
+	// pages of a block are programmed in ascending order (a retry repeats one)
+	if (row % PAGES_PER_BLOCK < sim.top[row / PAGES_PER_BLOCK]) {
+		fprintf(stderr, "\nsim: page %ld programmed after page %ld of its block\n",
+			row, row - row % PAGES_PER_BLOCK + sim.top[row / PAGES_PER_BLOCK]);
+		exit(2);
+	}
+	sim.top[row / PAGES_PER_BLOCK] = row % PAGES_PER_BLOCK;
+	if (sim_fault(sim_cfg.prog_fail))
+		return 1;
+	for (i = 0; i < PAGE_SIZE; i++)
+		sim.array[row * PAGE_SIZE + i] &= data[i];
+	return 0;
+}
+
+static int sim_erase(long row, int wp)
+{
+	row &= ~(long)(PAGES_PER_BLOCK - 1);
+	if (!wp || row >= sim.pages)
+		return 1;
+	memset(sim.array + row * PAGE_SIZE, 0xFF, (size_t)PAGES_PER_BLOCK * PAGE_SIZE);
+	sim.top[row / PAGES_PER_BLOCK] = -1;
+	return 0;
+}
+
+/*
+ * Protocol checks. A real part aborts or garbles the cache register when a
+ * new operation starts inside a 31h cache read sequence, or a read, erase
+ * or ID starts before the array is idle, so the run stops here instead of
+ * carrying on with data the hardware would not give.
+ */
+static void sim_check(unsigned char c)
+{
+	const char *err = NULL;
+
+	switch (c) {
+	case 0x31: case 0x3F: case 0x05: case 0xE0: case 0x70: case 0xFF:
+		return;
+	}
+	if (sim.cache_open)
+		err = "inside a 31h cache read that no 3Fh has ended";
+	else if ((c == 0x00 || c == 0x60 || c == 0x90) && sim_now() < sim.array_until)
+		err = "before the array is idle (ARDY)";
+	if (err) {
+		fprintf(stderr, "\nsim: command %02Xh %s\n", c, err);
+		sim.cache_open = 0; // reported
+		exit(2);
+	}
+}
+
+/* the part keeps its state after the run, so none may end inside a 31h sequence */
+static void sim_exit(void)
+{
+	if (sim.cache_open) {
+		fflush(NULL);
+		fprintf(stderr, "\nsim: exit inside a 31h cache read that no 3Fh has ended\n");
+		_exit(2);
+	}
+}
+
+static void sim_command(unsigned char c)
+{
+	long row;
+	long long t;
+	int fail;
+	int wp = (sim.lev >> N_WRITE_PROTECT) & 1;
+
+	sim_check(c);
+	switch (c) {
+	case 0xFF:
+		sim.state = SIM_IDLE;
+		sim.sensed = -1;
+		sim.cache_open = 0;
+		sim.fail = sim.failc = 0;
+		sim.queued = -1;
+		sim_busy(5);
+		break;
+	case 0x90:
+		sim.cmd = c; sim.naddr = 0; sim.id_index = 0;
+		sim.state = SIM_ID;
+		break;
+	case 0x05:
+		// 00h addr 05h picks the plane register after a two-plane read
+		row = sim_row(2);
+		if (sim.cmd == 0x00 && sim.naddr == 5 && sim.plane_row[sim_plane(row)] == row)
+			memcpy(sim.cache_reg, sim.plane_reg[sim_plane(row)], PAGE_SIZE);
+		sim.cmd = c; sim.naddr = 0;
+		break;
+	case 0x60:
+		if (sim_cfg.planes > 1 && sim.cmd == 0x60 && sim.naddr == 3)
+			sim.queued = sim_row(0);
+		else
+			sim.queued = -1;
+		sim.cmd = c; sim.naddr = 0;
+		sim.state = SIM_IDLE;
+		break;
+	case 0x00:
+		sim.cmd = c; sim.naddr = 0;
+		sim.state = SIM_IDLE;
+		break;
+	case 0x80:
+	case 0x81:
+		if (c == 0x80 || sim_cfg.planes < 2)
+			sim.queued = -1;
+		sim.cmd = 0x80; sim.naddr = 0;
+		sim.sensed = -1;
+		memset(sim.cache_reg, 0xFF, PAGE_SIZE);
+		sim.state = SIM_DATA_IN;
+		break;
+	case 0x11:
+		if (sim.cmd != 0x80 || sim.naddr != 5 || sim_cfg.planes < 2)
+			break;
+		sim.queued = sim_row(2);
+		memcpy(sim.queued_data, sim.cache_reg, PAGE_SIZE);
+		sim.cmd = 0;
+		sim.state = SIM_IDLE;
+		sim_busy(1); // tDBSY
+		break;
+	case 0x30:
+		if (sim.cmd == 0x60 && sim.naddr == 3 && sim.queued >= 0) {
+			row = sim_row(0);
+			sim.plane_row[0] = sim.plane_row[1] = -1;
+			if (sim_plane(row) != sim_plane(sim.queued)) {
+				sim_sense(sim.queued);
+				memcpy(sim.plane_reg[sim_plane(sim.queued)], sim.page_reg, PAGE_SIZE);
+				sim.plane_row[sim_plane(sim.queued)] = sim.queued;
+				sim_sense(row);
+				memcpy(sim.plane_reg[sim_plane(row)], sim.page_reg, PAGE_SIZE);
+				sim.plane_row[sim_plane(row)] = row;
+			}
+			sim.sensed = -1;
+			sim.queued = -1;
+			sim.state = SIM_IDLE;
+			sim_busy(sim_cfg.tR);
+			break;
+		}
+		if (sim.cmd != 0x00 || sim.naddr != 5)
+			break;
+		sim_sense(sim_row(2));
+		memcpy(sim.cache_reg, sim.page_reg, PAGE_SIZE);
+		sim.column = sim.addr[0] | (sim.addr[1] << 8);
+		sim.state = SIM_DATA_OUT;
+		sim_busy(sim_cfg.tR);
+		break;
+	case 0x31:
+	case 0x3F:
+		if (sim.sensed >= 0) {
+			sim.cache_open = c == 0x31;
+			sim_cache_read(c == 0x31);
+		}
+		break;
+	case 0xE0:
+		if (sim.cmd != 0x05 || sim.naddr != 2)
+			break;
+		sim.column = sim.addr[0] | (sim.addr[1] << 8);
+		sim.state = SIM_DATA_OUT;
+		break;
+	case 0x10:
+	case 0x15:
+		if (sim.cmd != 0x80 || sim.naddr != 5)
+			break;
+		// the cache register moves on once the previous program is done
+		t = sim_now();
+		if (t < sim.array_until)
+			t = sim.array_until;
+		row = sim_row(2);
+		sim.failc = sim.fail;
+		fail = sim_bad_pair(row) || sim_program(row, sim.cache_reg, wp);
+		if (sim.queued >= 0)
+			fail |= sim_program(sim.queued, sim.queued_data, wp);
+		sim.fail = fail;
+		sim.queued = -1;
+		sim.cmd = 0;
+		sim.state = SIM_IDLE;
+		sim.array_until = t + sim_cfg.tPROG * 1000LL;
+		sim.busy_until = c == 0x15 ? t + sim_cfg.tRCBSY * 1000LL : sim.array_until;
+		break;
+	case 0xD0:
+		if (sim.cmd != 0x60 || sim.naddr != 3)
+			break;
+		sim.failc = sim.fail;
+		fail = sim_bad_pair(sim_row(0)) || sim_erase(sim_row(0), wp);
+		if (sim.queued >= 0)
+			fail |= sim_erase(sim.queued, wp);
+		sim.fail = fail;
+		sim.queued = -1;
+		sim.cmd = 0;
+		sim.state = SIM_IDLE;
+		sim_busy(sim_cfg.tBERS);
+		break;
+	case 0x70:
+		sim.state = SIM_STATUS;
+		break;
+	default:
+		sim.cmd = 0;
+		sim.state = SIM_IDLE;
+	}
+}
+
+static void sim_address(unsigned char a)
+{
+	if (sim.naddr < 5)
+		sim.addr[sim.naddr++] = a;
+	if (sim.cmd == 0x80 && sim.naddr == 5)
+		sim.column = sim.addr[0] | (sim.addr[1] << 8);
+}
+
+static void sim_data_in(unsigned char d)
+{
+	if (sim.state == SIM_DATA_IN && sim.naddr == 5 && sim.column < PAGE_SIZE)
+		sim.cache_reg[sim.column++] = d;
+}
+
+static unsigned char sim_data_out(void)
+{
+	switch (sim.state) {
+	case SIM_ID:
+		if (sim_fault(sim_cfg.glitch))
+			return 0x00;
+		return sim.id_index < 5 ? sim_cfg.id[sim.id_index++] : 0x00;
+	case SIM_DATA_OUT:
+		if (sim.column >= PAGE_SIZE)
+			return 0xFF;
+		return sim.cache_reg[sim.column++] ^ (sim_fault(sim_cfg.flip) ? 1 << (rand() & 7) : 0);
+	case SIM_STATUS:
+		if (sim_fault(sim_cfg.glitch))
+			return 0x00;
+		return (sim_ready() ? 0x40 : 0x00) | (sim_now() >= sim.array_until ? 0x20 : 0x00) |
+			(((sim.lev >> N_WRITE_PROTECT) & 1) << 7) | (sim.failc << 1) | sim.fail;
+	default:
+		return 0xFF;
+	}
+}
+
+static void sim_pins(unsigned int lev)
+{
+	unsigned int old = sim.lev, rose = ~old & lev, fell = old & ~lev;
+	unsigned char b;
+
+	sim.lev = lev;
+	if (lev & (1u << N_CHIP_ENABLE))
+		return;
+	if (rose & (1u << N_WRITE_ENABLE)) {
+		b = data_bus.in[0][lev & 0xff] | data_bus.in[1][(lev >> 8) & 0xff] |
+			data_bus.in[2][(lev >> 16) & 0xff] | data_bus.in[3][lev >> 24];
+		if (lev & (1u << COMMAND_LATCH_ENABLE))
+			sim_command(b);
+		else if (lev & (1u << ADDRESS_LATCH_ENABLE))
+			sim_address(b);
+		else
+			sim_data_in(b);
+	}
+	if (fell & (1u << N_READ_ENABLE))
+		sim.dout = sim_data_out();
+}
+
+static unsigned int sim_levels(void)
+{
+	unsigned int v = sim.lev & ~(1u << N_READ_BUSY);
+	int r, bus_in = 1;
+
+	if (sim_ready())
+		v |= 1u << N_READ_BUSY;
+	for (r = 0; r < 4; r++)
+		if (sim.fsel[r] & data_bus.fsel_mask[r])
+			bus_in = 0;
+	if (bus_in && !(sim.lev & ((1u << N_READ_ENABLE) | (1u << N_CHIP_ENABLE))))
+		v = (v & ~data_bus.mask) | data_bus.set[sim.dout];
+	return v;
+}
+
+static int sim_open(void)
+{
+	struct stat st;
+	off_t size, old;
+	int fd = open(sim_cfg.image, O_RDWR | O_CREAT, 0644);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror("open simulator image");
+		return -1;
+	}
+	old = st.st_size - st.st_size % PAGE_SIZE;
+	size = (off_t)sim_cfg.pages * PAGE_SIZE;
+	if (old > size)
+		size = old;
+	if (st.st_size < size && ftruncate(fd, size) < 0) {
+		perror("ftruncate simulator image");
+		close(fd);
+		return -1;
+	}
+	sim.array = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sim.array == MAP_FAILED) {
+		perror("mmap simulator image");
+		return -1;
+	}
+	if (size > old)
+		memset(sim.array + old, 0xFF, size - old); // fresh pages are erased
+	sim.pages = size / PAGE_SIZE;
+	if ((sim.top = (signed char *)malloc(sim.pages / PAGES_PER_BLOCK + 1)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(sim.top, -1, sim.pages / PAGES_PER_BLOCK + 1);
+	sim.lev = (1u << N_CHIP_ENABLE) | (1u << N_WRITE_ENABLE) | (1u << N_READ_ENABLE);
+	sim.sensed = sim.queued = -1;
+	if (sim_cfg.planes > 1 && !(sim_cfg.id[4] & 0x0C))
+		sim_cfg.id[4] |= 0x04; // ID byte 5: two planes
+	sim.plane_row[0] = sim.plane_row[1] = -1;
+	atexit(sim_exit);
+	printf("simulated NAND: %s, %ld pages, tR %uus tPROG %uus tBERS %uus\n",
+		sim_cfg.image, sim.pages, sim_cfg.tR, sim_cfg.tPROG, sim_cfg.tBERS);
+	return 0;
+}
+
+struct SimBackend {
+	static INLINE unsigned int rd(int reg)
+	{
+		if (reg == GPLEV0)
+			return sim_levels();
+		return reg < 6 ? sim.fsel[reg] : 0;
+	}
+	static INLINE void wr(int reg, unsigned int v)
+	{
+		if (reg < 6)
+			sim.fsel[reg] = v;
+		else if (reg == GPSET0)
+			sim_pins(sim.lev | v);
+		else if (reg == GPCLR0)
+			sim_pins(sim.lev & ~v);
+	}
+};
+
+typedef SimBackend GpioBackend;
+static int gpio_backend = BACKEND_SIM;
+
+#else
+
+typedef MmioBackend GpioBackend;
+static int gpio_backend = BACKEND_DEVMEM;
+
+#endif
+
 INLINE void init_perfcounters (int32_t do_reset, int32_t enable_divider){
 	// in general enable all counters (including cycle counter)
 	int32_t value = 1;
@@ -105,50 +658,315 @@ INLINE long ccnt_read(){
 	return cc;
 }
 
+/*
+ * Cycle counter for timing our own code. CCNT can only be used from
+ * userspace once the kernel has set PMUSERENR; init_cycle_counter() probes
+ * it under a SIGILL handler and otherwise falls back to CLOCK_MONOTONIC, in
+ * which case one "cycle" is one nanosecond. Deltas are taken modulo 2^32,
+ * which is plenty for a single bus phase.
+ */
+static int ccnt_usable = 0;
+static int cycle_counter_ready = 0;
+static double cycles_per_ns = 1.0;
+
+#if defined(__arm__)
+static sigjmp_buf ccnt_probe_env;
+
+static void ccnt_probe_sigill(int sig)
+{
+	(void)sig;
+	siglongjmp(ccnt_probe_env, 1);
+}
+#endif
+
+static INLINE uint32_t cycles_now(void)
+{
+	struct timespec ts;
+
+#if defined(__arm__)
+	if (ccnt_usable)
+		return ccnt_read();
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static long long monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-template<int X> class NopEmitter {
-	public:
-	INLINE void nop() {
-		asm volatile("nop");
+static void init_cycle_counter(void)
+{
+	long long t0, t1;
+	uint32_t c0, c1;
+
+	if (cycle_counter_ready)
+		return;
+	cycle_counter_ready = 1;
+#if defined(__arm__)
+	struct sigaction sa, old;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = ccnt_probe_sigill;
+	sigaction(SIGILL, &sa, &old);
+	if (sigsetjmp(ccnt_probe_env, 1) == 0) {
+		init_perfcounters(1, 0);
+		ccnt_read();
+		ccnt_usable = 1;
 	}
+	sigaction(SIGILL, &old, NULL);
+#endif
+	if (!ccnt_usable)
+		return;
+
+	// calibrate against the monotonic clock over ~20ms
+	t0 = monotonic_ns(); c0 = cycles_now();
+	while ((t1 = monotonic_ns()) - t0 < 20000000)
+		;
+	c1 = cycles_now();
+	cycles_per_ns = (double)(uint32_t)(c1 - c0) / (t1 - t0);
+}
+
+/*
+ * Opt-in (--profile) per-phase profiler. prof_lap(phase) charges the time
+ * since the previous lap to phase, so a loop is instrumented by calling it
+ * at the end of each step. Totals and log2 latency histograms are printed
+ * by prof_report() when read_full/write_full/erase_blocks finish.
+ */
+enum { PH_CMD, PH_BUSY, PH_DATA, PH_IDCHECK, PH_VERIFY, PH_FILEIO, PH_OTHER, PH_COUNT };
+
+static const char *phase_names[PH_COUNT] = {
+	"command/address", "R/B# busy", "data transfer", "read_id check", "verify", "file I/O", "other"
 };
-template<int X> INLINE void Nop() {
-	Nop<X - 1>();
-	NopEmitter<X-1> nop;
-	nop.nop();
+
+#define PROF_BUCKETS 32
+
+static struct {
+	int enabled;
+	uint32_t last;
+	unsigned long long total[PH_COUNT];
+	unsigned long long count[PH_COUNT];
+	unsigned long long hist[PH_COUNT][PROF_BUCKETS]; // by log2(ns)
+} prof;
+
+static INLINE void prof_lap(int phase)
+{
+	uint32_t now, d;
+
+	if (!prof.enabled)
+		return;
+	now = cycles_now();
+	d = now - prof.last;
+	prof.last = now;
+	prof.total[phase] += d;
+	prof.count[phase]++;
+	prof.hist[phase][d ? 31 - __builtin_clz((uint32_t)(d / cycles_per_ns) | 1) : 0]++;
+}
+
+static void prof_start(void)
+{
+	if (!prof.enabled)
+		return;
+	init_cycle_counter();
+	memset(prof.total, 0, sizeof(prof.total));
+	memset(prof.count, 0, sizeof(prof.count));
+	memset(prof.hist, 0, sizeof(prof.hist));
+	prof.last = cycles_now();
 }
-template<> INLINE void Nop<1>() {
-	NopEmitter<0> nop;
-	nop.nop();
+
+static void prof_report(const char *what)
+{
+	unsigned long long sum = 0;
+	int ph, b;
+
+	if (!prof.enabled)
+		return;
+	for (ph = 0; ph < PH_COUNT; ph++)
+		sum += prof.total[ph];
+	printf("\nProfile of %s (%s):\n", what, ccnt_usable ? "cycle counter" : "CLOCK_MONOTONIC");
+	printf("  %-16s %10s %12s %6s %10s\n", "phase", "count", "total ms", "%", "mean us");
+	for (ph = 0; ph < PH_COUNT; ph++) {
+		if (!prof.count[ph])
+			continue;
+		printf("  %-16s %10llu %12.3f %6.2f %10.3f\n", phase_names[ph], prof.count[ph],
+			prof.total[ph] / cycles_per_ns / 1e6, sum ? 100.0 * prof.total[ph] / sum : 0.0,
+			prof.total[ph] / cycles_per_ns / 1e3 / prof.count[ph]);
+	}
+	printf("\nLatency histograms (ns, log2 buckets):\n");
+	for (ph = 0; ph < PH_COUNT; ph++) {
+		if (!prof.count[ph])
+			continue;
+		printf("  %s\n", phase_names[ph]);
+		for (b = 0; b < PROF_BUCKETS; b++)
+			if (prof.hist[ph][b])
+				printf("    [%10llu, %10llu) %llu\n", 1ULL << b, 2ULL << b, prof.hist[ph][b]);
+	}
 }
 
-#define CPU_MHZ 700
 
-constexpr int insns_per_nsec(int nsec){
-	double div = (double)CPU_MHZ / 1000;
-	return ceil(nsec / div);
+/*
+ * Bus trace (--trace=<file.vcd>). Every GPSET0/GPCLR0/GPLEV0/GPFSEL access
+ * made by the primitives is stamped with cycles_now() and stored in a
+ * preallocated ring that keeps the most recent --trace-depth accesses. The
+ * producer only stores the entry and then publishes the new head, so a
+ * reader never takes a lock. trace_export() turns the ring into a VCD file
+ * when the program exits. Recording costs one counter read and three stores
+ * per access; with CCNT that is small next to the peripheral access itself.
+ */
+struct trace_entry {
+	uint32_t t;
+	uint32_t v;
+	uint32_t reg;
+};
+
+static struct {
+	int enabled;
+	const char *path;
+	uint32_t depth;
+	trace_entry *ring;
+	uint32_t head;      // number of entries ever recorded
+} trace = { 0, NULL, 1 << 20, NULL, 0 };
+
+static INLINE void trace_record(int reg, unsigned int v)
+{
+	uint32_t h = trace.head;
+	trace_entry *e = &trace.ring[h & (trace.depth - 1)];
+
+	e->t = cycles_now();
+	e->v = v;
+	e->reg = reg;
+	__atomic_store_n(&trace.head, h + 1, __ATOMIC_RELEASE);
 }
 
-#define NSLEEP(x) Nop<insns_per_nsec(x)>()
+static INLINE unsigned int gpio_rd(int reg)
+{
+	unsigned int v = GpioBackend::rd(reg);
+
+	if (__builtin_expect(trace.enabled, 0))
+		trace_record(reg, v);
+	return v;
+}
 
+static INLINE void gpio_wr(int reg, unsigned int v)
+{
+	if (__builtin_expect(trace.enabled, 0))
+		trace_record(reg, v);
+	GpioBackend::wr(reg, v);
+}
 
-#define tCH() NSLEEP(5);
-#define tWC() NSLEEP(25)
-#define tWB() NSLEEP(100)
+static void trace_export(void)
+{
+	static const struct { int gpio; char id; const char *name; } pins[] = {
+		{ N_CHIP_ENABLE, '!', "CE_n" }, { COMMAND_LATCH_ENABLE, '"', "CLE" },
+		{ ADDRESS_LATCH_ENABLE, '#', "ALE" }, { N_WRITE_ENABLE, '$', "WE_n" },
+		{ N_READ_ENABLE, '%', "RE_n" }, { N_WRITE_PROTECT, '&', "WP_n" },
+		{ N_READ_BUSY, '\'', "RB_n" },
+	};
+	const int npins = sizeof(pins) / sizeof(pins[0]);
+	uint32_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+	uint32_t first = head > trace.depth ? head - trace.depth : 0, i, prev_t = 0;
+	unsigned int lev = 0, known = 0, old_lev, old_known;
+	int bus_out = -1, old_bus, p, b;
+	unsigned long long ns = 0;
+	FILE *f;
+
+	if (!trace.enabled || head == first)
+		return;
+	trace.enabled = 0;
+	if ((f = fopen(trace.path, "w")) == NULL) {
+		perror("fopen trace file");
+		return;
+	}
+	fprintf(f, "$comment rpi-tsop48-nand bus trace, %u of %u accesses $end\n", head - first, head);
+	fprintf(f, "$timescale 1ns $end\n$scope module nand $end\n");
+	for (p = 0; p < npins; p++)
+		fprintf(f, "$var wire 1 %c %s $end\n", pins[p].id, pins[p].name);
+	fprintf(f, "$var wire 8 ( IO $end\n$var wire 1 ) bus_out $end\n");
+	fprintf(f, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+	for (p = 0; p < npins; p++)
+		fprintf(f, "x%c\n", pins[p].id);
+	fprintf(f, "bxxxxxxxx (\nx)\n$end\n");
+
+	for (i = first; i != head; i++) {
+		trace_entry *e = &trace.ring[i & (trace.depth - 1)];
+
+		if (i != first)
+			ns += (uint32_t)(e->t - prev_t) / cycles_per_ns;
+		prev_t = e->t;
+		old_lev = lev; old_known = known; old_bus = bus_out;
+		if (e->reg == GPSET0) {
+			lev |= e->v; known |= e->v;
+		} else if (e->reg == GPCLR0) {
+			lev &= ~e->v; known |= e->v;
+		} else if (e->reg == GPLEV0) {
+			// a sample shows what the chip drives: R/B#, and the bus when it is an input
+			unsigned int m = (1u << N_READ_BUSY) | (bus_out == 0 ? data_bus.mask : 0);
+			lev = (lev & ~m) | (e->v & m); known |= m;
+		} else if (e->reg < 4 && data_bus.fsel_mask[e->reg]) {
+			bus_out = (e->v & data_bus.fsel_mask[e->reg]) == data_bus.fsel_out[e->reg];
+		}
+		if (lev == old_lev && known == old_known && bus_out == old_bus)
+			continue;
+		fprintf(f, "#%llu\n", ns);
+		for (p = 0; p < npins; p++) {
+			unsigned int m = 1u << pins[p].gpio;
+			if ((lev ^ old_lev) & m || (known ^ old_known) & m)
+				fprintf(f, "%c%c\n", known & m ? (lev & m ? '1' : '0') : 'x', pins[p].id);
+		}
+		if ((lev ^ old_lev) & data_bus.mask || (known ^ old_known) & data_bus.mask) {
+			fputc('b', f);
+			for (b = 7; b >= 0; b--) {
+				unsigned int m = 1u << data_to_gpio_map[b];
+				fputc(known & m ? (lev & m ? '1' : '0') : 'x', f);
+			}
+			fprintf(f, " (\n");
+		}
+		if (bus_out != old_bus)
+			fprintf(f, "%d)\n", bus_out);
+	}
+	fclose(f);
+	printf("bus trace with %u accesses written to %s\n", head - first, trace.path);
+}
 
-//#define CLE_1()
+static int trace_start(void)
+{
+	uint32_t depth = 1;
+
+	while (depth < trace.depth)
+		depth <<= 1;
+	trace.depth = depth;
+	trace.ring = (trace_entry *)calloc(depth, sizeof(trace_entry));
+	if (trace.ring == NULL) {
+		perror("allocating trace buffer");
+		return -1;
+	}
+	init_cycle_counter();
+	atexit(trace_export);
+	trace.enabled = 1;
+	return 0;
+}
 
 static INLINE int read_id(unsigned char id[5]);
 static INLINE int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare);
 static INLINE int write_pages(int first_page_number, int number_of_pages, char *infile);
 static INLINE int erase_blocks(int first_block_number, int number_of_blocks);
+static int bench(const char *delays, int iterations, int scratch_block);
+static int oob_scan(int first_block_number, int number_of_blocks, const char *spare_file);
+static int read_range(long long offset, long long length, const char *outfile, int full);
+static int read_part(const char *mtdparts, const char *name, const char *outfile);
+static int ubi_dump(int first_block_number, int number_of_blocks, const char *outfile);
+static int calibrate(int first_page, int pages, int passes, const char *profile);
+static int merge(const char *output, int n, char **inputs);
+static int export_dump(const char *container, const char *output, int first, int pages);
 
 static INLINE void INP_GPIO(int g)
 {
 #ifdef DEBUG
 	printf("setting direction of GPIO#%d to input\n", g);
 #endif
-	(*(gpio+((g)/10)) &= ~(7<<(((g)%10)*3)));
+	gpio_wr(GPFSEL0 + g / 10, gpio_rd(GPFSEL0 + g / 10) & ~(7 << ((g % 10) * 3)));
 }
 
 static INLINE void OUT_GPIO(int g)
@@ -157,7 +975,7 @@ static INLINE void OUT_GPIO(int g)
 #ifdef DEBUG
 	printf("setting direction of GPIO#%d to output\n", g);
 #endif
-	*(gpio+((g)/10)) |= (1<<(((g)%10)*3));
+	gpio_wr(GPFSEL0 + g / 10, gpio_rd(GPFSEL0 + g / 10) | (1 << ((g % 10) * 3)));
 }
 
 static INLINE void GPIO_SET_1(int g)
@@ -165,7 +983,7 @@ static INLINE void GPIO_SET_1(int g)
 #ifdef DEBUG
 	printf("setting GPIO#%d to 1\n", g);
 #endif
-	*(gpio +  7)  = 1 << g;
+	gpio_wr(GPSET0, 1 << g);
 }
 
 static INLINE void GPIO_SET_0(int g)
@@ -173,45 +991,77 @@ static INLINE void GPIO_SET_0(int g)
 #ifdef DEBUG
 	printf("setting GPIO#%d to 0\n", g);
 #endif
-	*(gpio + 10)  = 1 << g;
+	gpio_wr(GPCLR0, 1 << g);
 }
 
 static INLINE int GPIO_READ(int g)
 {
-	int x = (*(gpio + 13) & (1 << g)) >> g;
+	int x = (gpio_rd(GPLEV0) & (1 << g)) >> g;
 #ifdef DEBUG
 	printf("GPIO#%d reads as %d\n", g, x);
 #endif
 	return x;
 }
 
+/*
+ * Final GPFSEL words for "bus in" and "bus out", computed once by
+ * init_data_direction() after all other pins have been configured. A switch
+ * is then a plain store to each GPFSEL register holding a data pin, and no
+ * store at all when the bus already points the right way.
+ * Don't INP_GPIO()/OUT_GPIO() a pin sharing those registers afterwards, it
+ * would be overwritten by the cached words.
+ */
+static unsigned int fsel_word_in[4], fsel_word_out[4];
+static int data_direction = -1; // 0 = in, 1 = out, -1 = unknown
+
+static void init_data_direction(void)
+{
+	int r;
+
+	for (r = 0; r < 4; r++) {
+		if (!data_bus.fsel_mask[r])
+			continue;
+		fsel_word_in[r] = gpio_rd(GPFSEL0 + r) & ~data_bus.fsel_mask[r];
+		fsel_word_out[r] = fsel_word_in[r] | data_bus.fsel_out[r];
+	}
+	data_direction = -1;
+}
+
 static INLINE void set_data_direction_in(void)
 {
-	int i;
+	int r;
+
+	if (data_direction == 0)
+		return;
 #ifdef DEBUG
 	printf("data direction => IN\n");
 #endif
-	for (i = 0; i < 8; i++)
-		INP_GPIO(data_to_gpio_map[i]);
+	for (r = 0; r < 4; r++)
+		if (data_bus.fsel_mask[r])
+			gpio_wr(GPFSEL0 + r, fsel_word_in[r]);
+	data_direction = 0;
 }
 
 static INLINE void set_data_direction_out(void)
 {
-	int i;
+	int r;
+
+	if (data_direction == 1)
+		return;
 #ifdef DEBUG
 	printf("data direction => OUT\n");
 #endif
-	for (i = 0; i < 8; i++)
-		OUT_GPIO(data_to_gpio_map[i]);
+	for (r = 0; r < 4; r++)
+		if (data_bus.fsel_mask[r])
+			gpio_wr(GPFSEL0 + r, fsel_word_out[r]);
+	data_direction = 1;
 }
 
 static INLINE int GPIO_DATA8_IN(void)
 {
-	int i, data;
-	for (i = data = 0; i < 8; i++, data = data << 1) {
-		data |= GPIO_READ(data_to_gpio_map[7 - i]);
-	}
-	data >>= 1;
+	unsigned int lev = gpio_rd(GPLEV0);
+	int data = data_bus.in[0][lev & 0xff] | data_bus.in[1][(lev >> 8) & 0xff] |
+		data_bus.in[2][(lev >> 16) & 0xff] | data_bus.in[3][lev >> 24];
 #ifdef DEBUG
 	printf("GPIO_DATA8_IN: data=%02x\n", data);
 #endif
@@ -220,870 +1070,4566 @@ static INLINE int GPIO_DATA8_IN(void)
 
 static INLINE void GPIO_DATA8_OUT(int data)
 {
-	int i;
 #ifdef DEBUG
 	printf("GPIO_DATA8_OUT: data=%02x\n", data);
 #endif
-	for (i = 0; i < 8; i++, data >>= 1) {
-		if (data & 1)
-			GPIO_SET_1(data_to_gpio_map[i]);
-		else
-			GPIO_SET_0(data_to_gpio_map[i]);
-	}
+	data &= 0xff;
+	gpio_wr(GPSET0, data_bus.set[data]);
+	gpio_wr(GPCLR0, data_bus.clr[data]);
 }
 
-int delay = 1;
-static INLINE void shortpause()
+/*
+ * Bus timing engine. Every edge waits for the one ONFI parameter that
+ * governs it, kept in nanoseconds and turned into spin-loop counts by
+ * timing_apply() using a loop rate calibrated against the cycle counter.
+ * The <delay> argument selects the source:
+ *   a number       legacy mode, every edge spins <delay> loops
+ *   onfi0..onfi5   ONFI SDR timing mode
+ *   <file>         timing profile, one "tWP 25" style line per parameter
+ * Only the part of a parameter not already covered by an earlier wait is
+ * spun: the CLE/ALE setup spins tCLS/tALS - tWP, the RE# high time is
+ * tRC - tREA, tWHR and tADL discount the preceding tWH (and tWP).
+ */
+enum { T_WP, T_WH, T_CLS, T_ALS, T_REA, T_RC, T_WB, T_ADL, T_WHR, T_COUNT };
+
+static const char *timing_names[T_COUNT] = {
+	"tWP", "tWH", "tCLS", "tALS", "tREA", "tRC", "tWB", "tADL", "tWHR"
+};
+
+// ONFI 2.x SDR timing modes 0-5, ns
+static const unsigned onfi_timing_modes[6][T_COUNT] = {
+	{ 50, 30, 50, 50, 40, 100, 200, 400, 120 },
+	{ 25, 15, 25, 25, 30,  50, 100, 400,  80 },
+	{ 17, 15, 15, 15, 25,  35, 100, 400,  80 },
+	{ 15, 10, 10, 10, 20,  30, 100, 400,  60 },
+	{ 12, 10, 10, 10, 20,  25, 100, 400,  60 },
+	{ 10,  7, 10, 10, 16,  20, 100, 400,  60 },
+};
+
+int delay = 1;                      // legacy uniform delay, in loops
+static int timing_uniform = 1;
+static unsigned timing_ns[T_COUNT];
+static unsigned timing_base_ns[T_COUNT];
+static int timing_base_delay = 1;
+static int timing_loops[T_COUNT];
+static double loops_per_ns = 0.0;
+
+static INLINE void spin(int loops)
 {
 	int i;
 	static volatile int dontcare = 0;
-	for (i = 0; i < delay; i++) {
+	for (i = 0; i < loops; i++) {
 		dontcare++;
 	}
 }
 
+static INLINE void tpause(int t)
+{
+	spin(timing_loops[t]);
+}
 
-#define DEBUG_STATUS_LED_GPIO 16
+/*
+ * A pause only the uniform <delay> takes. The original code paused after
+ * every edge, 5 times per command cycle and 3 times per data byte, and the
+ * delays tuned for it count on that; the per-parameter waits need none.
+ */
+static INLINE void upause(void)
+{
+	if (timing_uniform)
+		spin(delay);
+}
 
-static INLINE void debug_status(bool value){
-	if(value){
-		GPIO_SET_0(DEBUG_STATUS_LED_GPIO);
-	} else {
-		GPIO_SET_1(DEBUG_STATUS_LED_GPIO);
-	}
+static void timing_calibrate(void)
+{
+	uint32_t c0, c1;
+	int n = 1 << 16;
+
+	if (loops_per_ns > 0.0)
+		return;
+	init_cycle_counter();
+	do {
+		n <<= 1;
+		c0 = cycles_now();
+		spin(n);
+		c1 = cycles_now();
+	} while ((uint32_t)(c1 - c0) / cycles_per_ns < 5000000 && n < (1 << 28));
+	loops_per_ns = n / ((uint32_t)(c1 - c0) / cycles_per_ns);
 }
 
-static INLINE void debug_blink(){
-	GPIO_SET_1(DEBUG_STATUS_LED_GPIO);
-	GPIO_SET_0(DEBUG_STATUS_LED_GPIO);
+static INLINE int ns_to_loops(int ns)
+{
+	return ns > 0 ? (int)ceil(ns * loops_per_ns) : 0;
 }
 
-/*
-INLINE void shortpause()
+/* what is left of a after b, in signed math: ONFI mode 4 has tCLS < tWP */
+static INLINE int ns_after(unsigned a, unsigned b)
 {
-    struct timespec ts;
-    ts.tv_sec = delay / 1000;
-    ts.tv_nsec = (delay % 1000) * 1000000;
-    nanosleep(&ts, NULL);
-}*/
+	return (int)a > (int)b ? (int)a - (int)b : 0;
+}
 
-int main(int argc, char **argv)
-{ 
-	int mem_fd;
+/* a parameter that may not be shorter than the wait covering it, or NULL.
+ * tCLS and tALS may be shorter than tWP, as in ONFI modes 2-4. */
+static const char *timing_check(const unsigned ns[T_COUNT])
+{
+	if (ns[T_RC] < ns[T_REA])
+		return "tRC is shorter than tREA";
+	return NULL;
+}
 
-	printf("\nRasPS3 (b3)\na Raspberry GPIO flasher for PS3 NANDs, by littlebalup\n\n");
+/* recomputes timing_loops[] from delay or timing_ns[] */
+static void timing_apply(void)
+{
+	int t;
+	const unsigned *n = timing_ns;
 
-	if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC)) < 0) {
-		perror("open /dev/mem, are you root?");
-		return -1;
+	if (timing_uniform) {
+		for (t = 0; t < T_COUNT; t++)
+			timing_loops[t] = delay;
+		return;
 	}
+	timing_calibrate();
+	timing_loops[T_WP] = ns_to_loops(n[T_WP]);
+	timing_loops[T_WH] = ns_to_loops(n[T_WH]);
+	timing_loops[T_CLS] = ns_to_loops(ns_after(n[T_CLS], n[T_WP]));
+	timing_loops[T_ALS] = ns_to_loops(ns_after(n[T_ALS], n[T_WP]));
+	timing_loops[T_REA] = ns_to_loops(n[T_REA]);
+	timing_loops[T_RC] = ns_to_loops(ns_after(n[T_RC], n[T_REA]));
+	timing_loops[T_WB] = ns_to_loops(n[T_WB]);
+	timing_loops[T_ADL] = ns_to_loops(ns_after(n[T_ADL], n[T_WH] + n[T_WP]));
+	timing_loops[T_WHR] = ns_to_loops(ns_after(n[T_WHR], n[T_WH]));
+}
 
-	if(setpriority(PRIO_PROCESS, getpid(), -20) < 0){
-		perror("renice failed, are you root?");
+static void timing_set_uniform(int loops)
+{
+	timing_uniform = 1;
+	delay = timing_base_delay = loops;
+	timing_apply();
+}
+
+static void timing_set_ns(const unsigned ns[T_COUNT])
+{
+	timing_uniform = 0;
+	memcpy(timing_ns, ns, sizeof(timing_ns));
+	memcpy(timing_base_ns, ns, sizeof(timing_base_ns));
+	timing_apply();
+}
+
+static int timing_load(const char *path)
+{
+	unsigned ns[T_COUNT];
+	char name[16];
+	unsigned v;
+	int t, seen = 0;
+	char line[128];
+	const char *err;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL)
+		return -1;
+	memcpy(ns, onfi_timing_modes[0], sizeof(ns));
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%15s %u", name, &v) != 2)
+			continue;
+		for (t = 0; t < T_COUNT; t++) {
+			if (strcmp(name, timing_names[t]) == 0) {
+				ns[t] = v;
+				seen++;
+			}
+		}
+	}
+	fclose(f);
+	if (!seen) {
+		printf("%s: no timing parameters found\n", path);
 		return -1;
 	}
-
-	if ((gpio = (volatile unsigned int *) mmap((caddr_t) 0x13370000, 4096, PROT_READ|PROT_WRITE,
-						MAP_SHARED|MAP_FIXED, mem_fd, GPIO_BASE)) == MAP_FAILED) {
-		perror("mmap GPIO_BASE");
-		close(mem_fd);
+	if ((err = timing_check(ns)) != NULL) {
+		printf("%s: %s\n", path, err);
 		return -1;
 	}
+	timing_set_ns(ns);
+	return 0;
+}
 
-	OUT_GPIO(DEBUG_STATUS_LED_GPIO);
-	
-	INP_GPIO(N_READ_BUSY);
-
-	OUT_GPIO(N_WRITE_PROTECT);
-	GPIO_SET_1(N_WRITE_PROTECT);
+static int timing_save(const char *path, const char *comment)
+{
+	int t;
+	FILE *f = fopen(path, "w");
 
-	OUT_GPIO(N_READ_ENABLE);
-	GPIO_SET_1(N_READ_ENABLE);
+	if (f == NULL) {
+		perror("fopen timing profile");
+		return -1;
+	}
+	fprintf(f, "# rpi-tsop48-nand timing profile, nanoseconds\n");
+	if (comment)
+		fprintf(f, "# %s\n", comment);
+	for (t = 0; t < T_COUNT; t++)
+		fprintf(f, "%s %u\n", timing_names[t], timing_ns[t]);
+	fclose(f);
+	return 0;
+}
 
-	OUT_GPIO(N_WRITE_ENABLE);
-	GPIO_SET_1(N_WRITE_ENABLE);
+/* parses the <delay> argument: loop count, "onfi<mode>" or a profile file */
+static int timing_parse(const char *arg)
+{
+	char *end;
+	long v;
 
-	OUT_GPIO(COMMAND_LATCH_ENABLE);
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
+	if (strncmp(arg, "onfi", 4) == 0 && arg[4] >= '0' && arg[4] <= '5' && arg[5] == 0) {
+		timing_set_ns(onfi_timing_modes[arg[4] - '0']);
+		return 0;
+	}
+	v = strtol(arg, &end, 10);
+	if (end != arg && (*end == 0 || *end == ',')) {
+		timing_set_uniform(v);
+		return 0;
+	}
+	return timing_load(arg);
+}
 
-	OUT_GPIO(ADDRESS_LATCH_ENABLE);
-	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
+static void timing_print(void)
+{
+	int t;
 
-	OUT_GPIO(N_CHIP_ENABLE);
-	GPIO_SET_0(N_CHIP_ENABLE);
+	if (timing_uniform) {
+		printf("Bus timing: uniform delay of %d loops per edge\n", delay);
+		return;
+	}
+	printf("Bus timing:");
+	for (t = 0; t < T_COUNT; t++)
+		printf(" %s=%u", timing_names[t], timing_ns[t]);
+	printf(" ns (%.3f loops/ns)\n", loops_per_ns);
+}
 
-	if (argc < 3) {
-usage:
-		GPIO_SET_1(N_CHIP_ENABLE);
-		printf("usage: sudo %s <delay> <command> ...\n\n" \
-		    " <delay> used to slow down operations (50 should work, increase if bad reads)\n\n" \
-		    "Commands:\n" \
-		    " read_id (no arguments)                        : read and decrypt chip ID\n" \
-		    " read_full <page #> <# of pages> <output file> : read N pages including spare\n" \
-		    " read_data <page #> <# of pages> <output file> : read N pages, discard spare\n" \
-		    " write_full <page #> <# of pages> <input file> : write N pages, including spare\n" \
-		    " write_data <page #> <# of pages> <input file> : write N pages, discard spare\n" \
-		    " erase_blocks <block number> <# of blocks>     : erase N blocks\n\n" \
-		    "Notes:\n" \
-		    " This program assumes PAGE_SIZE == %d\n" \
-		    " Run as root (sudo) required (for /dev/mem access)\n\n",
-			argv[0], PAGE_SIZE);
-		close(mem_fd);
-		return -1;
+/*
+ * Scales the timing last set by timing_set_uniform()/timing_set_ns() to
+ * pct percent, without changing that base. No parameter is scaled below
+ * its ONFI mode 5 minimum, or below the base where that is faster still.
+ */
+static void timing_scale(int pct)
+{
+	int t;
+	unsigned v, min;
+
+	if (timing_uniform) {
+		delay = (timing_base_delay * pct + 99) / 100;
+	} else {
+		for (t = 0; t < T_COUNT; t++) {
+			v = (timing_base_ns[t] * pct + 99) / 100;
+			min = timing_base_ns[t] < onfi_timing_modes[5][t] ? timing_base_ns[t] : onfi_timing_modes[5][t];
+			timing_ns[t] = v > min ? v : min;
+		}
 	}
+	timing_apply();
+}
 
-	//hide cursor
-	// printf("\e[?25l");
-	// fflush(stdout);
+/*
+ * Closed-loop speed control for long reads (--adaptive[=<start %>]). The
+ * run starts at start % of the given timing. Every failed double-read
+ * compare doubles the scale, capped at 100% (the given timing, which is
+ * assumed to be safe). Every ADAPT_STREAK clean pages in a row take a
+ * quarter off again, down to the floor where an edge would get shorter than
+ * its ONFI mode 5 minimum. A page the ECC sends back for a second read
+ * counts as a failure. Each change is logged to timing.log.
+ */
+#define ADAPT_STREAK 256
+
+static struct {
+	int enabled;
+	int start;
+	int scale;
+	int floor;                  // lowest scale, %
+	int clean;
+	long changes;
+	FILE *log;
+} adapt = { 0, 25, 100, 1, 0, 0, NULL };
 
-	delay = atoi(argv[1]);
-	// if (delay < 20) {
-	// 	printf("delay must be >= 20\n");
-	// 	return -1;
-	// }
+/*
+ * Scale at which every edge is down to its ONFI mode 5 minimum (per-edge
+ * timings are held there by timing_scale()). A uniform <delay> spins the
+ * same loops on every edge, so there the longest single-edge wait it
+ * stands in for, tREA, sets the floor.
+ */
+static int adapt_floor(void)
+{
+	int t, pct, floor = 1;
 
-	if (strcmp(argv[2], "read_id") == 0) {
-		return read_id(NULL);
+	if (timing_uniform) {
+		timing_calibrate();
+		if (timing_base_delay <= 0)
+			return 100;
+		floor = (100 * ns_to_loops(onfi_timing_modes[5][T_REA]) + timing_base_delay - 1) / timing_base_delay;
+	} else {
+		for (t = 0; t < T_COUNT; t++) {
+			if (timing_base_ns[t] <= onfi_timing_modes[5][t])
+				continue;
+			pct = (100 * onfi_timing_modes[5][t] + timing_base_ns[t] - 1) / timing_base_ns[t];
+			if (pct > floor)
+				floor = pct;
+		}
 	}
+	return floor < 100 ? floor : 100;
+}
 
-	if (strcmp(argv[2], "read_full") == 0) {
-		if (argc != 6) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of pages must be > 0\n");
-			return -1;
-		}
-		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 1);
+static void adapt_set(int page, int scale, const char *why)
+{
+	if (scale < adapt.floor)
+		scale = adapt.floor;
+	if (scale > 100)
+		scale = 100;
+	if (scale == adapt.scale)
+		return;
+	adapt.scale = scale;
+	adapt.changes++;
+	timing_scale(scale);
+	if (adapt.log) {
+		fprintf(adapt.log, "page %d: %d%% ", page, scale);
+		if (timing_uniform)
+			fprintf(adapt.log, "(delay %d) after %s\n", delay, why);
+		else
+			fprintf(adapt.log, "(tRC %u ns, tREA %u ns) after %s\n", timing_ns[T_RC], timing_ns[T_REA], why);
+		fflush(adapt.log);
 	}
+}
 
-	if (strcmp(argv[2], "read_data") == 0) {
-		if (argc != 6) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of pages must be > 0\n");
-			return -1;
-		}
-		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 0);
+static int adapt_start(void)
+{
+	if (!adapt.enabled)
+		return 0;
+	if ((adapt.log = fopen("timing.log", "w+")) == NULL) {
+		perror("fopen timing.log");
+		return -1;
 	}
+	adapt.scale = 100;
+	adapt.floor = adapt_floor();
+	adapt.clean = 0;
+	adapt.changes = 0;
+	fprintf(adapt.log, "floor %d%%\n", adapt.floor);
+	adapt_set(0, adapt.start, "start");
+	return 0;
+}
 
-	if (strcmp(argv[2], "write_full") == 0) {
-		if (argc != 6) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of pages must be > 0\n");
-			return -1;
-		}
-		return write_pages(atoi(argv[3]), atoi(argv[4]), argv[5]);
+/* reports the outcome of one page to the controller: 0 clean, 1 compare failed, 2 ECC reread */
+static INLINE void adapt_page(int page, int failed)
+{
+	if (!adapt.enabled)
+		return;
+	if (failed) {
+		adapt.clean = 0;
+		adapt_set(page, adapt.scale * 2, failed > 1 ? "ECC reread" : "mismatch");
+	} else if (++adapt.clean >= ADAPT_STREAK) {
+		adapt.clean = 0;
+		adapt_set(page, adapt.scale * 3 / 4, "clean streak");
 	}
+}
 
-	if (strcmp(argv[2], "erase_blocks") == 0) {
-		if (argc != 5) goto usage;
-		if (atoi(argv[4]) <= 0) {
-			printf("# of blocks must be > 0\n");
-			return -1;
-		}
-		return erase_blocks(atoi(argv[3]), atoi(argv[4]));
+static void adapt_finish(void)
+{
+	if (!adapt.enabled)
+		return;
+	printf("Adaptive timing: %ld changes, finished at %d%%, trajectory in timing.log\n", adapt.changes, adapt.scale);
+	fclose(adapt.log);
+	adapt.log = NULL;
+	timing_scale(100);
+}
+
+/*
+ * Single-read verification (--verify=ecc:<scheme>). Instead of clocking
+ * every page out twice, the ECC the flash driver stored in the spare area
+ * is recomputed for each 512 byte sector. A sector with no more bit flips
+ * than ecc.threshold is taken as read correctly: flips of that size are
+ * cell errors, and a second transfer would return the same bits. Anything
+ * worse, or uncorrectable, sends the page through the usual second read
+ * and compare.
+ * Schemes, in the layouts Linux uses for 2048+64 byte pages:
+ *  hamming  3 bytes/512 (Linux software ECC, 512 byte steps), spare 52
+ *  bch4     7 bytes/512, GF(2^13) polynomial 0x201b, spare 36
+ *  bch8     13 bytes/512, same field, spare 12
+ * BCH codes carry the Linux erased-page mask, so blank pages check clean.
+ * Other layouts come from a file with "scheme bch8", "offset 12",
+ * "stride 13" (ECC bytes from one sector to the next) and "threshold 2"
+ * lines.
+ */
+enum { ECC_NONE, ECC_HAMMING, ECC_BCH };
+
+#define ECC_STEP	512
+#define ECC_SECTORS	(PAGE_SIZE / ECC_STEP)
+#define ECC_DATA_SIZE	(ECC_SECTORS * ECC_STEP)
+#define BCH_M		13
+#define BCH_N		((1 << BCH_M) - 1)
+#define BCH_POLY	0x201b
+#define BCH_MAX_T	8
+
+static struct {
+	int scheme;
+	int t;                      // BCH: correctable bits per sector
+	int bytes;                  // ECC bytes per sector
+	int offset, stride;         // in the spare area
+	int threshold;              // bit flips per sector accepted, -1 = default
+	int deg;                    // BCH generator degree, BCH_M * t
+	uint64_t g[2];              // generator without x^deg, left-aligned
+	uint64_t table[256][2];     // remainder of byte * x^deg, left-aligned
+	unsigned char mask[16];     // inverted ECC of an erased sector
+	unsigned short exp[2 * BCH_N], log[BCH_N + 1];
+	long single, flips, rereads;
+} ecc = { ECC_NONE, 0, 0, 0, 0, -1, 0, {}, {}, {}, {}, {}, 0, 0, 0 };
+
+/* 16 byte GCC vector, one NEON/SSE2 register */
+typedef uint64_t vec128 __attribute__((vector_size(16)));
+
+static INLINE int ecc_parity(uint64_t x)
+{
+	return __builtin_parityll(x);
+}
+
+/*
+ * Linux software Hamming ECC of one 512 byte sector. rp(2k)/rp(2k+1) are the
+ * parities of the bytes whose address bit k is 0/1, the column parities
+ * come from the XOR of all bytes. One pass of 16 byte vector XORs gives the
+ * XOR of all bytes and, for address bits 4..8, of the vectors whose index
+ * has that bit set; address bits 0..3 are lanes inside a vector.
+ */
+static void hamming_calculate(const unsigned char *d, unsigned char code[3])
+{
+	static const uint64_t lanes[3] = { 0xFF00FF00FF00FF00ULL, 0xFFFF0000FFFF0000ULL, 0xFFFFFFFF00000000ULL };
+	vec128 v, all = { 0, 0 }, odd[5] = {};
+	int one[9], zero[9];
+	uint64_t x;
+	int i, k, total;
+	unsigned par;
+
+	for (i = 0; i < ECC_STEP / 16; i++) {
+		memcpy(&v, d + 16 * i, 16);
+		all ^= v;
+		for (k = 0; k < 5; k++)
+			if ((i >> k) & 1)
+				odd[k] ^= v;
+	}
+	x = all[0] ^ all[1];
+	total = ecc_parity(x);
+	for (k = 0; k < 3; k++)
+		one[k] = ecc_parity(x & lanes[k]);
+	one[3] = ecc_parity(all[1]);
+	for (k = 0; k < 5; k++)
+		one[4 + k] = ecc_parity(odd[k][0] ^ odd[k][1]);
+	for (k = 0; k < 9; k++)
+		zero[k] = total ^ one[k];
+	x ^= x >> 32;
+	x ^= x >> 16;
+	x ^= x >> 8;
+	par = x & 0xff;
+
+	// stored as inverted parities, rp15..rp8 first
+	code[0] = code[1] = 0;
+	for (k = 0; k < 4; k++) {
+		code[1] |= (!zero[k] << (2 * k)) | (!one[k] << (2 * k + 1));
+		code[0] |= (!zero[k + 4] << (2 * k)) | (!one[k + 4] << (2 * k + 1));
 	}
+	code[2] = (!ecc_parity(par & 0xf0) << 7) | (!ecc_parity(par & 0x0f) << 6) |
+		(!ecc_parity(par & 0xcc) << 5) | (!ecc_parity(par & 0x33) << 4) |
+		(!ecc_parity(par & 0xaa) << 3) | (!ecc_parity(par & 0x55) << 2) |
+		(!one[8] << 1) | !zero[8];
+}
 
-	printf("unknown command '%s'\n", argv[2]);
-	goto usage;
-	return 0;
+/* bit flips in one sector: 0, 1, or -1 if uncorrectable */
+static int hamming_check(const unsigned char *d, const unsigned char *stored)
+{
+	unsigned char code[3];
+	int i, single = 1, bits = 0;
+
+	hamming_calculate(d, code);
+	for (i = 0; i < 3; i++) {
+		code[i] ^= stored[i];
+		bits += __builtin_popcount(code[i]);
+		if (((code[i] ^ (code[i] >> 1)) & 0x55) != 0x55)
+			single = 0;
+	}
+	if (bits == 0)
+		return 0;
+	if (single || bits == 1) // one data bit, or one bit of the ECC itself
+		return 1;
+	return -1;
 }
 
-void error_msg(const char *msg)
+static INLINE unsigned short gf_mul(unsigned short a, unsigned short b)
 {
-	printf("%s\nBe sure to check wiring, and check that pressure is applied on both sides of 360 Clip\n" \
-		"sometimes it is required to move slightly the 360 Clip in case of a false contact\n", msg);
+	return a && b ? ecc.exp[ecc.log[a] + ecc.log[b]] : 0;
 }
 
-void print_id(unsigned char id[5])
+/* remainder register: 128 bits, hi:lo, the polynomial left-aligned */
+static INLINE void bch_shift8(uint64_t r[2], unsigned char in)
 {
-	unsigned int i, bit, page_size, ras_size, orga, plane_number;
-	unsigned long block_size, plane_size, nand_size, nandras_size;
-	char maker[16], device[16], serial_access[20];
-	unsigned *thirdbits = (unsigned*)malloc(sizeof(unsigned) * 8);
-	unsigned *fourthbits = (unsigned*)malloc(sizeof(unsigned) * 8);
-	unsigned *fifthbits = (unsigned*)malloc(sizeof(unsigned) * 8);
+	unsigned char top = (r[0] >> 56) ^ in;
 
-	printf("Raw ID data: ");
-	for (i = 0; i < 5; i++)
-		printf("0x%02X ", id[i]);
-	printf("\n");
+	r[0] = (r[0] << 8) | (r[1] >> 56);
+	r[1] <<= 8;
+	r[0] ^= ecc.table[top][0];
+	r[1] ^= ecc.table[top][1];
+}
 
- 	switch(id[0]) {
- 		case 0xEC: {
- 			strcpy(maker, "Samsung");
- 			switch(id[1]) {
- 				case 0xA1: strcpy(device, "K9F1G08R0A"); break;
- 				case 0xD5: strcpy(device, "K9GAG08U0M"); break;
- 				case 0xF1: strcpy(device, "K9F1G08U0A/B"); break;
- 				default: strcpy(device, "unknown");
- 			}
- 			break;
- 		}
- 		case 0xAD: {
- 			strcpy(maker, "Hynix");
- 			switch(id[1]) {
- 				case 0x73: strcpy(device, "HY27US08281A"); break;
- 				case 0xD7: strcpy(device, "H27UBG8T2A"); break;
- 				case 0xDA: strcpy(device, "HY27UF082G2B"); break;
- 				case 0xDC: strcpy(device, "H27U4G8F2D"); break;
- 				default: strcpy(device, "unknown");
- 			}
- 			break;
- 		}
- 		default: strcpy(maker, "unknown"); strcpy(device, "unknown");
- 	}
+static void bch_encode(const unsigned char *d, unsigned char *code)
+{
+	uint64_t r[2] = { 0, 0 };
+	int i;
 
-/* all sizes in bytes */
-	for(bit = 0; bit < 8; ++bit)
-		thirdbits[bit] = (id[2] >> bit) & 1;
+	for (i = 0; i < ECC_STEP; i++)
+		bch_shift8(r, d[i]);
+	for (i = 0; i < ecc.bytes; i++)
+		code[i] = (i < 8 ? r[0] >> (56 - 8 * i) : r[1] >> (120 - 8 * i)) ^ ecc.mask[i];
+}
 
-	for(bit = 0; bit < 8; ++bit)
-		fourthbits[bit] = (id[3] >> bit) & 1;
-	switch(fourthbits[1] * 10 + fourthbits[0]) {
-		case 00: page_size = 1024; break;
-		case 01: page_size = 2048; break;
-		case 10: page_size = 4096; break;
-		case 11: page_size = 8192; break;
+static void bch_init(int t)
+{
+	static unsigned char used[BCH_N];
+	unsigned short g[BCH_M * BCH_MAX_T + 1];
+	unsigned char erased[ECC_STEP];
+	int i, j, k, c, deg = 0, x = 1;
+	uint64_t r[2];
+
+	for (i = 0; i < BCH_N; i++) {
+		ecc.exp[i] = ecc.exp[i + BCH_N] = x;
+		ecc.log[x] = i;
+		x <<= 1;
+		if (x & (1 << BCH_M))
+			x ^= BCH_POLY;
 	}
-	switch(fourthbits[5] * 10 + fourthbits[4]) {
-		case 00: block_size = 64 * 1024; break;
-		case 01: block_size = 128 * 1024; break;
-		case 10: block_size = 256 * 1024; break;
-		case 11: block_size = 521 * 1024; break;
+
+	// product of the minimal polynomials of alpha^1, alpha^3 .. alpha^(2t-1)
+	memset(used, 0, sizeof(used));
+	g[0] = 1;
+	for (j = 1; j < 2 * t; j += 2) {
+		for (c = j; !used[c]; c = 2 * c % BCH_N) {
+			used[c] = 1;
+			g[++deg] = 0;
+			for (k = deg; k > 0; k--)
+				g[k] = g[k - 1] ^ gf_mul(g[k], ecc.exp[c]);
+			g[0] = gf_mul(g[0], ecc.exp[c]);
+		}
 	}
-	switch(fourthbits[2]) {
-		case 0: ras_size = 8; break; // for 512 bytes
-		case 1: ras_size = 16; break; // for 512 bytes
+	ecc.t = t;
+	ecc.deg = deg;
+	ecc.bytes = (deg + 7) / 8;
+	ecc.g[0] = ecc.g[1] = 0;
+	for (k = 0; k < deg; k++) // coefficient of x^(deg-1-k) goes to bit 127-k
+		if (g[deg - 1 - k])
+			ecc.g[k / 64] |= 1ULL << (63 - k % 64);
+
+	for (i = 0; i < 256; i++) {
+		r[0] = (uint64_t)i << 56;
+		r[1] = 0;
+		for (k = 0; k < 8; k++) {
+			int top = r[0] >> 63;
+
+			r[0] = (r[0] << 1) | (r[1] >> 63);
+			r[1] <<= 1;
+			if (top) {
+				r[0] ^= ecc.g[0];
+				r[1] ^= ecc.g[1];
+			}
+		}
+		ecc.table[i][0] = r[0];
+		ecc.table[i][1] = r[1];
 	}
-	switch(fourthbits[6]) {
-		case 0: orga = 8; break; // bits
-		case 1: orga = 16; break; // bits
+
+	memset(ecc.mask, 0, sizeof(ecc.mask));
+	memset(erased, 0xFF, sizeof(erased));
+	bch_encode(erased, ecc.mask);
+	for (i = 0; i < ecc.bytes; i++)
+		ecc.mask[i] ^= 0xFF;
+}
+
+/*
+ * bit flips in one sector, or -1 if uncorrectable: syndromes of the ECC
+ * difference, Berlekamp-Massey for the error locator, and a Chien search
+ * that has to find as many roots inside the codeword as its degree.
+ */
+static int bch_check(const unsigned char *d, const unsigned char *stored)
+{
+	unsigned char code[16];
+	unsigned short s[2 * BCH_MAX_T + 1], lambda[2 * BCH_MAX_T + 1], b[2 * BCH_MAX_T + 1], tmp[2 * BCH_MAX_T + 1];
+	unsigned short delta, bd = 1, sum;
+	int i, j, k, n, l = 0, m = 1, roots = 0, diff = 0;
+
+	bch_encode(d, code);
+	for (i = 0; i < ecc.bytes; i++)
+		diff |= code[i] ^= stored[i];
+	if (!diff)
+		return 0;
+
+	for (j = 1; j <= 2 * ecc.t; j++) {
+		s[j] = 0;
+		for (k = 0; k < ecc.deg; k++)
+			if ((code[k / 8] >> (7 - k % 8)) & 1)
+				s[j] ^= ecc.exp[(long)j * (ecc.deg - 1 - k) % BCH_N];
 	}
-	switch(fourthbits[7] * 10 + fourthbits[3]) {
-		case 00: strcpy(serial_access, "50ns/30ns minimum"); break;
-		case 10: strcpy(serial_access, "25ns minimum"); break;
-		case 01: strcpy(serial_access, "unknown (reserved)"); break;
-		case 11: strcpy(serial_access, "unknown (reserved)"); break;
+
+	memset(lambda, 0, sizeof(lambda));
+	memset(b, 0, sizeof(b));
+	lambda[0] = b[0] = 1;
+	for (n = 0; n < 2 * ecc.t; n++) {
+		delta = s[n + 1];
+		for (i = 1; i <= l; i++)
+			delta ^= gf_mul(lambda[i], s[n + 1 - i]);
+		if (!delta) {
+			m++;
+			continue;
+		}
+		memcpy(tmp, lambda, sizeof(tmp));
+		// lambda -= delta / bd * x^m * b
+		sum = ecc.exp[(ecc.log[delta] + BCH_N - ecc.log[bd]) % BCH_N];
+		for (i = 0; i + m <= 2 * ecc.t; i++)
+			lambda[i + m] ^= gf_mul(sum, b[i]);
+		if (2 * l <= n) {
+			l = n + 1 - l;
+			memcpy(b, tmp, sizeof(b));
+			bd = delta;
+			m = 1;
+		} else {
+			m++;
+		}
 	}
+	if (l > ecc.t)
+		return -1;
 
-	for(bit = 0; bit < 8; ++bit)
-		fifthbits[bit] = (id[4] >> bit) & 1;
-	switch(fifthbits[3] * 10 + fifthbits[2]) {
-		case 00: plane_number = 1; break;
-		case 01: plane_number = 2; break;
-		case 10: plane_number = 4; break;
-		case 11: plane_number = 8; break;
+	for (i = 0; i < ECC_STEP * 8 + ecc.deg; i++) {
+		sum = lambda[0];
+		for (k = 1; k <= l; k++)
+			if (lambda[k])
+				sum ^= ecc.exp[(ecc.log[lambda[k]] + (long)k * (BCH_N - i)) % BCH_N];
+		if (!sum)
+			roots++;
 	}
-	switch(fifthbits[6] * 100 + fifthbits[5] * 10 + fifthbits[4]) {
-		case 100: plane_size = 64 / 8 * 1024 * 1024; break; // 64 megabits
-		case 001: plane_size = 128 / 8 * 1024 * 1024; break; // 128 megabits
-		case 010: plane_size = 256 / 8 * 1024 * 1024; break; // 256 megabits
-		case 011: plane_size = 512 / 8 * 1024 * 1024; break; // 512 megabits
-		case 000: plane_size = 1024 / 8 * 1024 * 1024; break; // 1 gigabit
-		case 101: plane_size = 2048 / 8 * 1024 * 1024; break; // 2 gigabits
-		case 110: plane_size = 4096 / 8 * 1024 * 1024; break; // 4 gigabits
-		case 111: plane_size = 8192 / 8 * 1024 * 1024; break; // 8 gigabits
+	return roots == l ? l : -1;
+}
+
+static int ecc_select(const char *scheme)
+{
+	if (strcmp(scheme, "hamming") == 0) {
+		ecc.scheme = ECC_HAMMING;
+		ecc.bytes = 3;
+		ecc.offset = 52;
+	} else if (strcmp(scheme, "bch4") == 0) {
+		ecc.scheme = ECC_BCH;
+		bch_init(4);
+		ecc.offset = 36;
+	} else if (strcmp(scheme, "bch8") == 0) {
+		ecc.scheme = ECC_BCH;
+		bch_init(8);
+		ecc.offset = 12;
+	} else {
+		return -1;
+	}
+	ecc.stride = ecc.bytes;
+	return 0;
+}
+
+static int ecc_load(const char *path)
+{
+	char line[128], name[16], value[16];
+	FILE *f = fopen(path, "r");
+	int scheme = 0;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
 	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%15s %15s", name, value) != 2)
+			continue;
+		if (strcmp(name, "scheme") == 0) {
+			if (ecc_select(value) < 0)
+				break;
+			scheme = 1;
+		} else if (strcmp(name, "offset") == 0) {
+			ecc.offset = atoi(value);
+		} else if (strcmp(name, "stride") == 0) {
+			ecc.stride = atoi(value);
+		} else if (strcmp(name, "threshold") == 0) {
+			ecc.threshold = atoi(value);
+		}
+	}
+	fclose(f);
+	if (!scheme || ecc.offset < 0 || ecc.offset + (ECC_SECTORS - 1) * ecc.stride + ecc.bytes > PAGE_SIZE - ECC_DATA_SIZE) {
+		printf("%s: needs a scheme (hamming, bch4, bch8) and an ECC layout inside the spare area\n", path);
+		return -1;
+	}
+	return 0;
+}
 
-	nand_size = plane_number * plane_size;
-	nandras_size = nand_size + ras_size * nand_size / 512;
+/* --verify=ecc:<hamming|bch4|bch8|layout file> */
+static int ecc_setup(const char *arg)
+{
+	if (ecc_select(arg) < 0 && ecc_load(arg) < 0)
+		return -1;
+	if (ecc.threshold < 0)
+		ecc.threshold = ecc.scheme == ECC_HAMMING ? 1 : ecc.t / 2;
+	return 0;
+}
 
+/* worst sector of a page read once: bit flips, or -1 if uncorrectable */
+static int ecc_page(const unsigned char *buf)
+{
+	int i, flips, worst = 0;
+	const unsigned char *stored = buf + ECC_DATA_SIZE + ecc.offset;
 
-	printf("\n");
-	printf("NAND manufacturer:  %s (0x%02X)\n", maker, id[0]);
-	printf("NAND model:         %s (0x%02X)\n", device, id[1]);
-	printf("\n");
+	for (i = 0; i < ECC_SECTORS; i++, stored += ecc.stride) {
+		if (ecc.scheme == ECC_HAMMING)
+			flips = hamming_check(buf + i * ECC_STEP, stored);
+		else
+			flips = bch_check(buf + i * ECC_STEP, stored);
+		if (flips < 0)
+			return -1;
+		if (flips > worst)
+			worst = flips;
+	}
+	return worst;
+}
 
-	printf("              I/O|7|6|5|4|3|2|1|0|\n");
-	printf("3rd ID data:     |");
-	for(bit = 8; bit--;)
-        printf("%u|", thirdbits[bit]);
-    printf(" (0x%02X)\n", id[2]);
-	printf("4th ID data:     |");
-	for(bit = 8; bit--;)
-        printf("%u|", fourthbits[bit]);
-    printf(" (0x%02X)\n", id[3]);
-	printf("5th ID data:     |");
-	for(bit = 8; bit--;)
-        printf("%u|", fifthbits[bit]);
-    printf(" (0x%02X)\n", id[4]);
+/* whether the single read of a page can stand without a second one */
+static int ecc_verified(const unsigned char *buf)
+{
+	int flips = ecc_page(buf);
 
-	printf("\n");
-	printf("Page size:          %d bytes\n", page_size);
-	printf("Block size:         %zd bytes\n", block_size);
-	printf("RAS (/512 bytes):   %d bytes\n", ras_size);
-	// printf("RAS (per page):  %d bytes\n", ras_size * page_size / 512);
-	// printf("RAS (per block): %d bytes\n", ras_size * block_size / 512);
-	printf("Organisation:       %d bit\n", orga);
-	printf("Serial access:      %s\n", serial_access);
-	printf("Number of planes:   %u\n", plane_number);
-	printf("Plane size:         %zd bytes\n", plane_size);
-	printf("\n");
-	printf("NAND size:          %zd MB\n", nand_size / (1024 * 1024));
-	printf("NAND size + RAS:    %zd MB\n", nandras_size / (1024 * 1024));
-	printf("Number of blocks:   %zd\n", nand_size / block_size);
-	printf("Number of pages:    %zd\n", nand_size / page_size);
+	if (flips < 0 || flips > ecc.threshold) {
+		ecc.rereads++;
+		return 0;
+	}
+	ecc.single++;
+	ecc.flips += flips;
+	return 1;
 }
 
-static int read_id(unsigned char id[5])
+static void ecc_report(void)
 {
-	int i;
-	unsigned char buf[5];
+	if (ecc.scheme == ECC_NONE)
+		return;
+	printf("ECC verify: %ld pages from a single read (%ld bit flips accepted), %ld read again\n",
+		ecc.single, ecc.flips, ecc.rereads);
+}
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE); shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	set_data_direction_out(); GPIO_DATA8_OUT(0x90); // Read ID byte 1
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();set_data_direction_in();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+/*
+ * Link health (--link-check, --link-probe). read_full, write_full and
+ * erase_blocks used to read the ID before every page or block to catch a
+ * slipped clip; now that probe runs
+ *  page    before every page (and both copies of a read), the old behaviour
+ *  block   before the first page of each block
+ *  <N>ms   when N ms have passed since the last probe
+ *  error   only before retrying a failed compare, program or erase
+ * and a retry always probes first. The probe is either the 5 byte ID or a
+ * single 70h status read, compared with the status bits 7..5 (WP#, RDY,
+ * ARDY) the idle chip showed at the start. A failing probe is repeated
+ * until the link is back.
+ */
+enum { LINK_PAGE, LINK_BLOCK, LINK_INTERVAL, LINK_ERROR };
+enum { PROBE_ID, PROBE_STATUS };
+
+#define LINK_STATUS_MASK	0xE0
+
+static struct {
+	int mode;
+	int probe;
+	long long interval_ns;
+	long long last;
+	unsigned char id[5];
+	unsigned char status;
+	long probes, failures;
+} link_health = { LINK_PAGE, PROBE_ID, 0, 0, {}, 0, 0, 0 };
 
-	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	GPIO_SET_0(N_WRITE_ENABLE);
-	set_data_direction_out(); GPIO_DATA8_OUT(0x00); // Read ID byte 2
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause(); set_data_direction_in();
-	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
-	shortpause();
+/*
+ * Page whose data the chip's register still holds for 05h-E0h, -1 after
+ * anything that loads or switches the output somewhere else.
+ */
+static int register_page = -1;
 
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_0(N_READ_ENABLE);
-		shortpause();
-		buf[i] = GPIO_DATA8_IN(); //
-		GPIO_SET_1(N_READ_ENABLE);
-		shortpause();
-	}
-	if (id != NULL)
-		memcpy(id, buf, 5);
-	else
-		print_id(buf);
-	if (buf[0] == buf[1] && buf[1] == buf[2] && buf[2] == buf[3] && buf[3] == buf[4]) {
-		error_msg("all five ID bytes are identical, this is not normal");
+/*
+ * Cache operations (--cache).
+ * Read: after 31h the chip moves the page it has just sensed into the cache
+ * register and starts sensing the next one, so tR runs while the previous
+ * page is clocked out. 3Fh ends the sequence without starting another array
+ * read. cache.next_read is the page the running sequence hands out next,
+ * any other page starts a new one with 00h-30h.
+ * Program: 15h returns as soon as the cache register is free again, so the
+ * next page is clocked in while the previous one is programmed; the last
+ * page is confirmed with 10h.
+ * 90h is not allowed while the array is busy, so neither does a per-page
+ * ID check.
+ */
+static struct {
+	int enabled;
+	int next_read;
+} cache = { 0, -1 };
+
+/* pages of a block whose first spare byte is the factory bad block marker */
+#define BBM_MAX_PAGES	4
+
+static struct {
+	int n;
+	int page[BBM_MAX_PAGES];
+} bbm = { 2, { 0, 1 } };
+
+/* ubi_dump writes one image per volume instead of a sparse raw image */
+static struct {
+	int volumes;
+} ubi = { 0 };
+
+/*
+ * Two-plane operations (--planes), in the Samsung/Hynix command set. The
+ * plane is selected by the lowest block address bit, so blocks 2k and 2k+1
+ * form a pair and page p of an even block goes with p + PAGES_PER_BLOCK.
+ *  erase:   60h row 60h row D0h
+ *  program: 80h addr data 11h, tDBSY, 81h addr data 10h
+ *  read:    60h row 60h row 30h, then 00h addr 05h col E0h for each plane
+ * A read of the even page also fetches its partner, which is kept in
+ * stash until read_pages gets to it. Only used when the ID reports at
+ * least two planes.
+ */
+static struct {
+	int enabled;
+	int stash_page[2][PAGES_PER_BLOCK]; // per verification copy
+	unsigned char stash[2][PAGES_PER_BLOCK][PAGE_SIZE];
+} planes;
+
+/*
+ * Dump output (--output=). stdio writes each page with fwrite() as before.
+ * mmap preallocates the whole file and maps it, so a page is one memcpy
+ * and the kernel writes it back in the background. direct collects pages
+ * in an aligned OUT_BATCH buffer and writes it with O_DIRECT, bypassing
+ * the page cache, which is what SD cards like best. An output file named
+ * "-" streams the same batches to stdout (a pipe to a compressor or a
+ * hasher) and moves all messages to stderr; it takes no --output=. Pages
+ * are always written in order.
+ */
+enum { OUT_STDIO, OUT_MMAP, OUT_DIRECT, OUT_STREAM };
+
+#define OUT_BATCH	(1 << 20)	// multiple of the 4K O_DIRECT alignment
+
+static struct {
+	int mode;
+	int chosen;                 // --output= was given
+	FILE *f;                    // OUT_STDIO
+	int fd;
+	unsigned char *map;         // OUT_MMAP
+	unsigned char *batch;       // OUT_DIRECT, OUT_STREAM
+	size_t size, pos, fill;
+} out;
+
+/* called before the first message of a command dumping to "-": the dump gets the real stdout */
+static void out_stdout(void)
+{
+	out.fd = dup(1);
+	dup2(2, 1); // messages go to stderr from here on
+	fcntl(out.fd, F_SETPIPE_SZ, OUT_BATCH); // only a pipe takes this
+}
+
+/* an output file "-": streams to the stdout out_stdout() kept */
+static int out_stream(void)
+{
+	if (out.chosen) {
+		printf("--output= is for an output file, not for stdout (-)\n");
 		return -1;
 	}
+	out.mode = OUT_STREAM;
 	return 0;
 }
 
-static INLINE int page_to_address(int page, int address_byte_index)
+/*
+ * Dump container (--container, read_full only). Laid out so it can be
+ * written front to back through the output engine, stdout included, and
+ * mmap()ed for random access afterwards:
+ *   dump_header     ID bytes, decoded geometry, page range, bus timing
+ *   payload         the PAGE_SIZE pages that are not erased, in page order
+ *   dump_page[]     one index entry per page: payload offset (0 if erased),
+ *                   CRC32 of the page, flags and retries
+ *   dump_trailer    where the index starts, found from the end of the file
+ * All fields are little endian. export turns it back into a raw dump.
+ */
+#define DUMP_MAGIC		"NANDDUMP"
+#define DUMP_INDEX_MAGIC	"NANDINDX"
+#define DUMP_VERSION		1
+#define DUMP_TIMINGS		16	// room for T_COUNT
+
+enum { DUMP_ERASED = 1, DUMP_BAD = 2, DUMP_RETRIED = 4, DUMP_VOTED = 8 };
+
+struct dump_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint8_t id[8];              // 5 used
+	uint32_t page_size;         // of a payload page, PAGE_SIZE
+	uint32_t pages_per_block;
+	uint32_t data_size;         // decoded from the ID
+	uint32_t spare_per_512;
+	uint32_t block_size;
+	uint32_t planes;
+	uint64_t nand_size;
+	uint32_t first_page;
+	uint32_t pages;
+	uint32_t timing_uniform;    // 1: <delay> loops per edge, else timing_ns
+	uint32_t delay;
+	uint32_t timing_ns[DUMP_TIMINGS];
+};
+
+struct dump_page {
+	uint64_t offset;
+	uint32_t crc;
+	uint8_t flags;
+	uint8_t retries;
+	uint16_t reserved;
+};
+
+struct dump_trailer {
+	uint64_t index_offset;
+	uint32_t pages;
+	uint32_t index_crc;
+	char magic[8];
+};
+
+static struct {
+	int enabled;
+	dump_page *index;
+	int pages, count;
+	long erased, bad, retried, voted;
+} dump;
+
+/*
+ * Checkpoint journal, so an interrupted read_full/read_data/write_full/
+ * erase_blocks can be picked up again with --resume. Every run keeps a
+ * text journal next to its file (<file>.journal, erase_blocks.journal
+ * for erases):
+ *   read_full <first> <count>   the command and range, must match to resume
+ *   timing <delay>              the <delay> argument of the run
+ *   id ec f1 00 95 40           the chip, checked again before resuming
+ *   done <page>                 every page (block) before it is durable
+ *   bad <page>                  gave up on it
+ * "done" is appended every JOURNAL_BATCH pages (blocks), after the dump
+ * has been synced, so no more than one batch is repeated (JOURNAL_BLOCKS
+ * blocks for erases). The journal is
+ * removed when the command completes.
+ */
+#define JOURNAL_BATCH	256	// pages, a multiple of 4096 bytes in both dump layouts
+#define JOURNAL_BLOCKS	4	// erase_blocks
+
+static struct {
+	int resume;                 // --resume
+	const char *timing;         // the <delay> argument
+	FILE *f;
+	char path[1024];
+	int next, synced, bad;
+	int batch;                  // pages (blocks) between two "done" marks
+	int sync_out;               // sync the dump before recording progress
+	unsigned char id[5];
+	int have_id;
+} journal;
+
+/*
+ * Pipelined reader (--pipeline[=<cpu>]) for read_full/read_data. The
+ * calling thread becomes the bus thread, pinned to one core (the last one
+ * by default, meant to be kept free with isolcpus=). It only clocks pages
+ * into a pool of preallocated slots. A second thread compares the copies
+ * (or checks the ECC), keeps a CRC32 of the dump, writes the pages out
+ * and does the progress output and bad.log.
+ * Slots travel through three single-producer/single-consumer rings:
+ *  full   bus -> output, a slot holding a freshly read page
+ *  free   output -> bus, a slot that may be reused
+ *  retry  output -> bus, a slot whose page has to be read again
+ * so the bus thread never blocks on the filesystem or the terminal. Pages
+ * that arrive ahead of a retried one are held back in their slots, at most
+ * PIPE_SLOTS of them, so the dump is still written in order. Spans are not
+ * voted on here, since the page register has moved on by the time the
+ * output thread sees a mismatch.
+ */
+#define PIPE_SLOTS	64	// power of two
+
+struct spsc_ring {
+	int slot[PIPE_SLOTS];
+	unsigned head __attribute__((aligned(64)));  // written by the producer
+	unsigned tail __attribute__((aligned(64)));  // written by the consumer
+};
+
+struct pipe_slot {
+	int page;
+	int copies;                 // 1 with --verify=ecc, until the ECC asks for 2
+	int attempts;
+	int flags;                  // DUMP_BAD once it gave up
+	unsigned char buf[PAGE_SIZE * 2];
+};
+
+static struct {
+	int enabled;
+	int cpu;                    // -1: the last one
+	pipe_slot *slots;
+	spsc_ring full, free, retry;
+	int done;                   // set by the output thread
+	// output thread
+	int held[PIPE_SLOTS];       // slot + 1 of a verified page, by page % PIPE_SLOTS
+	FILE *badlog;
+	int first, pages;
+	size_t out_size;
+	uint32_t *crc;              // per page, combined at the end
+	long bad;
+} pipeline = { 0, -1, NULL, {}, {}, {}, 0, {}, NULL, 0, 0, 0, NULL, 0 };
+
+#define DEBUG_STATUS_LED_GPIO 16
+
+static INLINE void debug_status(bool value){
+	if(value){
+		GPIO_SET_0(DEBUG_STATUS_LED_GPIO);
+	} else {
+		GPIO_SET_1(DEBUG_STATUS_LED_GPIO);
+	}
+}
+
+static INLINE void debug_blink(){
+	GPIO_SET_1(DEBUG_STATUS_LED_GPIO);
+	GPIO_SET_0(DEBUG_STATUS_LED_GPIO);
+}
+
+/*
+INLINE void shortpause()
 {
-	switch(address_byte_index) {
-	//3rd: A12 A13 A14 A15 A16 A17 A18 A19
-	case 2:
-		return page & 0xff;
-	//4th: A20 A21 A22 A23 A24 A25 A26 A27
-	case 3:
-		return (page >>  8) & 0xff;
-	//5th: A28 A29 A30 L (1) L (1) L (1) L (1) L (1)
-	case 4:
-		return (page >> 16) & 0xff;
-	default:
+    struct timespec ts;
+    ts.tv_sec = delay / 1000;
+    ts.tv_nsec = (delay % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}*/
+
+/* handles one leading "--option" argument, returns -1 if it is unknown */
+static int parse_option(const char *opt)
+{
+	if (strcmp(opt, "--backend=devmem") == 0) {
+		gpio_backend = BACKEND_DEVMEM;
+		return 0;
+	}
+	if (strcmp(opt, "--backend=gpiomem") == 0) {
+		gpio_backend = BACKEND_GPIOMEM;
+		return 0;
+	}
+	if (strncmp(opt, "--trace=", 8) == 0) {
+		trace.path = opt + 8;
+		return 0;
+	}
+	if (strncmp(opt, "--trace-depth=", 14) == 0) {
+		trace.depth = strtoul(opt + 14, NULL, 0);
+		return 0;
+	}
+	if (strcmp(opt, "--adaptive") == 0 || strncmp(opt, "--adaptive=", 11) == 0) {
+		adapt.enabled = 1;
+		if (opt[10] == '=')
+			adapt.start = atoi(opt + 11);
+		return 0;
+	}
+	if (strncmp(opt, "--verify=ecc:", 13) == 0)
+		return ecc_setup(opt + 13);
+	if (strcmp(opt, "--verify=copy") == 0) {
+		ecc.scheme = ECC_NONE;
+		return 0;
+	}
+	if (strncmp(opt, "--ecc-threshold=", 16) == 0) {
+		ecc.threshold = atoi(opt + 16);
+		return 0;
+	}
+	if (strncmp(opt, "--link-check=", 13) == 0) {
+		const char *m = opt + 13;
+		char *end;
+
+		if (strcmp(m, "page") == 0)
+			link_health.mode = LINK_PAGE;
+		else if (strcmp(m, "block") == 0)
+			link_health.mode = LINK_BLOCK;
+		else if (strcmp(m, "error") == 0)
+			link_health.mode = LINK_ERROR;
+		else if (strtol(m, &end, 10) > 0 && strcmp(end, "ms") == 0) {
+			link_health.mode = LINK_INTERVAL;
+			link_health.interval_ns = strtol(m, NULL, 10) * 1000000LL;
+		} else
+			return -1;
+		return 0;
+	}
+	if (strcmp(opt, "--link-probe=id") == 0) {
+		link_health.probe = PROBE_ID;
+		return 0;
+	}
+	if (strcmp(opt, "--link-probe=status") == 0) {
+		link_health.probe = PROBE_STATUS;
+		return 0;
+	}
+	if (strcmp(opt, "--resume") == 0) {
+		journal.resume = 1;
+		return 0;
+	}
+	if (strcmp(opt, "--container") == 0) {
+		dump.enabled = 1;
+		return 0;
+	}
+	if (strncmp(opt, "--output=", 9) == 0) {
+		if (strcmp(opt + 9, "stdio") == 0)
+			out.mode = OUT_STDIO;
+		else if (strcmp(opt + 9, "mmap") == 0)
+			out.mode = OUT_MMAP;
+		else if (strcmp(opt + 9, "direct") == 0)
+			out.mode = OUT_DIRECT;
+		else
+			return -1;
+		out.chosen = 1;
+		return 0;
+	}
+	if (strcmp(opt, "--pipeline") == 0 || strncmp(opt, "--pipeline=", 11) == 0) {
+		pipeline.enabled = 1;
+		pipeline.cpu = opt[10] == '=' ? atoi(opt + 11) : -1;
+		return 0;
+	}
+	if (strcmp(opt, "--planes") == 0) {
+		planes.enabled = 1;
+		return 0;
+	}
+	if (strncmp(opt, "--bbm-pages=", 12) == 0) {
+		const char *p = opt + 12;
+		for (bbm.n = 0; bbm.n < BBM_MAX_PAGES && *p; bbm.n++) {
+			bbm.page[bbm.n] = strtol(p, (char **)&p, 10);
+			if (bbm.page[bbm.n] < 0 || bbm.page[bbm.n] >= PAGES_PER_BLOCK || (*p && *p++ != ','))
+				return -1;
+		}
+		return bbm.n && !*p ? 0 : -1;
+	}
+	if (strcmp(opt, "--ubi-volumes") == 0) {
+		ubi.volumes = 1;
+		return 0;
+	}
+	if (strcmp(opt, "--cache") == 0) {
+		cache.enabled = 1;
+		return 0;
+	}
+	if (strcmp(opt, "--profile") == 0) {
+		prof.enabled = 1;
+		return 0;
+	}
+	if (strcmp(opt, "--backend=mem") == 0) {
+		gpio_backend = BACKEND_MEM;
+		return 0;
+	}
+#ifdef NAND_SIM
+	if (strncmp(opt, "--sim-image=", 12) == 0) {
+		sim_cfg.image = opt + 12;
+		return 0;
+	}
+	if (strncmp(opt, "--sim-pages=", 12) == 0) {
+		sim_cfg.pages = atol(opt + 12);
+		return 0;
+	}
+	if (strncmp(opt, "--sim-tr=", 9) == 0) {
+		sim_cfg.tR = atoi(opt + 9);
+		return 0;
+	}
+	if (strncmp(opt, "--sim-tprog=", 12) == 0) {
+		sim_cfg.tPROG = atoi(opt + 12);
+		return 0;
+	}
+	if (strncmp(opt, "--sim-tbers=", 12) == 0) {
+		sim_cfg.tBERS = atoi(opt + 12);
+		return 0;
+	}
+	if (strncmp(opt, "--sim-flip=", 11) == 0) {
+		sim_cfg.flip = atoi(opt + 11);
+		return 0;
+	}
+	if (strncmp(opt, "--sim-glitch=", 13) == 0) {
+		sim_cfg.glitch = atoi(opt + 13);
+		return 0;
+	}
+	if (strncmp(opt, "--sim-prog-fail=", 16) == 0) {
+		sim_cfg.prog_fail = atoi(opt + 16);
+		return 0;
+	}
+	if (strncmp(opt, "--sim-ecc=", 10) == 0) {
+		sim_cfg.ecc = opt + 10;
+		return 0;
+	}
+	if (strncmp(opt, "--sim-planes=", 13) == 0) {
+		sim_cfg.planes = atoi(opt + 13) > 1 ? 2 : 1;
+		return 0;
+	}
+	if (strncmp(opt, "--sim-id=", 9) == 0 && strlen(opt + 9) == 10) {
+		for (int i = 0; i < 5; i++) {
+			char byte[3] = { opt[9 + 2 * i], opt[10 + 2 * i], 0 };
+			sim_cfg.id[i] = strtoul(byte, NULL, 16);
+		}
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+#ifdef NAND_SIM
+/*
+ * --sim-ecc: every page of the image that is not erased gets the scheme's
+ * ECC in its spare area, as if Linux had written it. The --verify=ecc
+ * settings are kept aside meanwhile.
+ */
+static int sim_write_ecc(void)
+{
+	static unsigned char saved[sizeof(ecc)];
+	unsigned char *page, *code;
+	long row;
+	int i;
+
+	memcpy(saved, &ecc, sizeof(ecc));
+	if (ecc_select(sim_cfg.ecc) < 0) {
+		printf("--sim-ecc: unknown scheme '%s'\n", sim_cfg.ecc);
+		return -1;
+	}
+	for (row = 0; row < sim.pages; row++) {
+		page = sim.array + row * PAGE_SIZE;
+		for (i = 0; i < ECC_DATA_SIZE && page[i] == 0xFF; i++)
+			;
+		if (i == ECC_DATA_SIZE)
+			continue;
+		for (i = 0; i < ECC_SECTORS; i++) {
+			code = page + ECC_DATA_SIZE + ecc.offset + i * ecc.stride;
+			if (ecc.scheme == ECC_HAMMING)
+				hamming_calculate(page + i * ECC_STEP, code);
+			else
+				bch_encode(page + i * ECC_STEP, code);
+		}
+	}
+	memcpy(&ecc, saved, sizeof(ecc));
+	return 0;
+}
+#endif
+
+static int open_gpio(int *mem_fd)
+{
+#ifdef NAND_SIM
+	*mem_fd = -1;
+	if (sim_open() < 0)
+		return -1;
+	return sim_cfg.ecc ? sim_write_ecc() : 0;
+#else
+	if (gpio_backend == BACKEND_MEM) {
+		// register file in plain memory, R/B# reads as ready
+		*mem_fd = -1;
+		gpio = (volatile unsigned int *)calloc(1024, sizeof(unsigned int));
+		gpio[GPLEV0] = 1u << N_READ_BUSY;
 		return 0;
 	}
-}
 
-static INLINE int send_read_command(int page)
-{
-	int i;
+	const char *dev = gpio_backend == BACKEND_GPIOMEM ? "/dev/gpiomem" : "/dev/mem";
+	off_t base = gpio_backend == BACKEND_GPIOMEM ? 0 : GPIO_BASE;
+
+	if ((*mem_fd = open(dev, O_RDWR|O_SYNC)) < 0) {
+		perror(gpio_backend == BACKEND_GPIOMEM ? "open /dev/gpiomem" : "open /dev/mem, are you root?");
+		return -1;
+	}
+
+	if ((gpio = (volatile unsigned int *) mmap((caddr_t) 0x13370000, 4096, PROT_READ|PROT_WRITE,
+						MAP_SHARED|MAP_FIXED, *mem_fd, base)) == MAP_FAILED) {
+		perror("mmap GPIO_BASE");
+		close(*mem_fd);
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+/* a whole non-negative number (decimal, or hex with 0x), -1 for anything else */
+static long arg_number(const char *arg)
+{
+	char *end;
+	long v = strtol(arg, &end, 0);
+
+	return end != arg && *end == 0 && v >= 0 && v <= INT_MAX ? v : -1;
+}
+
+/* whether the command (after the options) dumps to an output file "-" */
+static int dumps_to_stdout(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "export") == 0)
+		return strcmp(argv[argc - 1], "-") == 0;
+	return argc == 6 && strcmp(argv[5], "-") == 0 &&
+		(strncmp(argv[2], "read_", 5) == 0 || strcmp(argv[2], "oob_scan") == 0);
+}
+
+int main(int argc, char **argv)
+{
+	int mem_fd;
+
+	// leading --options; argv[0] moves along so the usage text still finds it
+	for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; argc--, argv++) {
+		if (parse_option(argv[1]) < 0) {
+			printf("unknown option '%s'\n", argv[1]);
+			return -1;
+		}
+		argv[1] = argv[0];
+	}
+
+	if (dumps_to_stdout(argc, argv))
+		out_stdout();
+	printf("\nRasPS3 (b3)\na Raspberry GPIO flasher for PS3 NANDs, by littlebalup\n\n");
+
+	// offline commands, no GPIO needed
+	if (argc > 2 && strcmp(argv[1], "merge") == 0)
+		return merge(argv[2], argc - 3, argv + 3);
+	if (argc > 1 && strcmp(argv[1], "export") == 0) {
+		if (argc == 4)
+			return export_dump(argv[2], argv[3], -1, 0);
+		if (argc == 6 && arg_number(argv[3]) >= 0 && arg_number(argv[4]) > 0)
+			return export_dump(argv[2], argv[5], arg_number(argv[3]), arg_number(argv[4]));
+		printf("usage: %s export <container> [<page #> <# of pages>] <output>\n", argv[0]);
+		return -1;
+	}
+
+	if (open_gpio(&mem_fd) < 0)
+		return -1;
+
+	if (trace.path != NULL && trace_start() < 0)
+		return -1;
+
+	if(setpriority(PRIO_PROCESS, getpid(), -20) < 0){
+		perror("renice failed, are you root?");
+		if (gpio_backend == BACKEND_DEVMEM)
+			return -1;
+	}
+
+	OUT_GPIO(DEBUG_STATUS_LED_GPIO);
+	
+	INP_GPIO(N_READ_BUSY);
+
+	OUT_GPIO(N_WRITE_PROTECT);
+	GPIO_SET_1(N_WRITE_PROTECT);
+
+	OUT_GPIO(N_READ_ENABLE);
+	GPIO_SET_1(N_READ_ENABLE);
+
+	OUT_GPIO(N_WRITE_ENABLE);
+	GPIO_SET_1(N_WRITE_ENABLE);
+
+	OUT_GPIO(COMMAND_LATCH_ENABLE);
+	GPIO_SET_0(COMMAND_LATCH_ENABLE);
+
+	OUT_GPIO(ADDRESS_LATCH_ENABLE);
+	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
+
+	OUT_GPIO(N_CHIP_ENABLE);
+	GPIO_SET_0(N_CHIP_ENABLE);
+
+	init_data_direction();
+	set_data_direction_in();
+
+	if (argc < 3) {
+usage:
+		GPIO_SET_1(N_CHIP_ENABLE);
+		printf("usage: sudo %s [options] <delay> <command> ...\n\n" \
+		    " <delay> used to slow down operations (50 should work, increase if bad reads)\n" \
+		    "         onfi0..onfi5 uses that ONFI timing mode for every bus edge instead,\n" \
+		    "         a file name loads per-parameter timings (tWP, tWH, tCLS, ... in ns)\n\n" \
+		    "Commands:\n" \
+		    " read_id (no arguments)                        : read and decrypt chip ID\n" \
+		    " read_full <page #> <# of pages> <output file> : read N pages including spare\n" \
+		    " read_data <page #> <# of pages> <output file> : read N pages, discard spare\n" \
+		    "                                                 (output file - is stdout)\n" \
+		    " read_range <offset> <length> <output file>    : read a byte range of the read_data\n" \
+		    "                                                 layout (MTD addresses)\n" \
+		    " read_range_full <offset> <length> <output file>\n" \
+		    "                                               : the same in the read_full layout\n" \
+		    " read_part <mtdparts> <name> <output file>     : read one partition of an MTD table,\n" \
+		    "                                                 e.g. \"2m(boot),-(ubi)\"\n" \
+		    " ubi_dump <block #> <# of blocks> <output>     : read only the PEBs of a UBI area that\n" \
+		    "                                                 hold volume data, sparse read_full\n" \
+		    "                                                 image + <output>.map\n" \
+		    " write_full <page #> <# of pages> <input file> : write N pages, including spare\n" \
+		    " write_data <page #> <# of pages> <input file> : write N pages, discard spare\n" \
+		    " erase_blocks <block number> <# of blocks>     : erase N blocks\n" \
+		    " oob_scan <block #> <# of blocks> [<spare file>]\n" \
+		    "                                               : bad block table from the marker bytes,\n" \
+		    "                                                 optionally the marker pages' spare areas\n" \
+		    " calibrate <page #> <# of pages> <passes> <profile file>\n" \
+		    "                                               : find the fastest clean bus timing\n" \
+		    " bench <iterations> [<scratch block>]          : time bus primitives and page sequences,\n" \
+		    "                                                 <delay> may be a list (1,10,50)\n\n" \
+		    "Offline commands (no <delay>, no GPIO access):\n" \
+		    " merge <output> <dump> <dump> [<dump> ...]     : bitwise majority of read_full dumps,\n" \
+		    "                                                 lists the pages that differ\n" \
+		    " export <container> [<page #> <# of pages>] <output>\n" \
+		    "                                               : --container dump back to read_full\n" \
+		    "                                                 layout, checking page CRCs\n\n" \
+		    "Options:\n" \
+		    " --backend=devmem|gpiomem|mem\n" \
+		    "                           : map GPIO through /dev/mem (default), /dev/gpiomem,\n" \
+		    "                             or a memory register file with no chip (for bench)\n" \
+		    " --trace=<file.vcd>        : record bus accesses, written as VCD on exit\n" \
+		    " --trace-depth=<n>         : keep the last n accesses (default 1M)\n" \
+		    " --adaptive[=<start %%>]   : read_full/read_data start at start %% (25) of <delay>,\n" \
+		    "                             slow down on mismatches, speed up on clean streaks\n" \
+		    " --verify=ecc:<scheme>     : read each page once and check it against the spare\n" \
+		    "                             area ECC (hamming, bch4, bch8 or a layout file),\n" \
+		    "                             read it again only when that finds too many errors\n" \
+		    " --ecc-threshold=<n>       : bit flips per 512 bytes taken as cell errors\n" \
+		    " --link-check=page|block|<N>ms|error\n" \
+		    "                           : how often the link is probed (default page)\n" \
+		    " --link-probe=id|status    : probe with read ID (default) or one status read\n" \
+		    " --output=stdio|mmap|direct: how read_full/read_data write the dump: fwrite\n" \
+		    "                             (default), a preallocated mmap()ed file, or 1 MiB\n" \
+		    "                             O_DIRECT batches\n" \
+		    " --resume                  : read_full/read_data/write_full/erase_blocks continue\n" \
+		    "                             an interrupted run from its <file>.journal (same\n" \
+		    "                             arguments, same chip)\n" \
+		    " --container               : read_full writes an indexed container: header with ID,\n" \
+		    "                             geometry and timing, page CRCs and flags, erased\n" \
+		    "                             pages left out (see export)\n" \
+		    " --pipeline[=<cpu>]        : read_full/read_data clock pages on a bus thread pinned\n" \
+		    "                             to <cpu> (last one) and verify/hash/write on another\n" \
+		    " --planes                  : two-plane read/program/erase on parts whose ID\n" \
+		    "                             reports two or more planes\n" \
+		    " --bbm-pages=<p>[,<p>...]  : pages of a block oob_scan checks (default 0,1)\n" \
+		    " --ubi-volumes             : ubi_dump writes <output>_<name>.img per volume\n" \
+		    " --cache                   : read_full/read_data use cache read (31h/3Fh), the\n" \
+		    "                             second copy is re-clocked from the cache register;\n" \
+		    "                             write_full/write_data use cache program (15h)\n" \
+		    " --profile                 : print per-phase time totals and latency histograms\n" \
+		    " --sim-image=<file> --sim-pages=<n> --sim-id=<10 hex digits>\n" \
+		    " --sim-tr=<us> --sim-tprog=<us> --sim-tbers=<us> --sim-planes=<n>\n" \
+		    " --sim-flip=<n> --sim-glitch=<n> --sim-prog-fail=<n> --sim-ecc=<scheme>\n" \
+		    "                           : simulated NAND settings (-DNAND_SIM builds)\n\n" \
+		    "Notes:\n" \
+		    " This program assumes PAGE_SIZE == %d\n" \
+		    " Run as root (sudo) required (for /dev/mem access)\n\n",
+			argv[0], PAGE_SIZE);
+		close(mem_fd);
+		return -1;
+	}
+
+	//hide cursor
+	// printf("\e[?25l");
+	// fflush(stdout);
+
+	journal.timing = argv[1];
+	if (timing_parse(argv[1]) < 0) {
+		printf("<delay> must be a number, onfi0..onfi5 or a timing profile file\n");
+		goto usage;
+	}
+	if (strcmp(argv[2], "bench") != 0)
+		timing_print();
+
+	if (strcmp(argv[2], "read_id") == 0) {
+		return read_id(NULL);
+	}
+
+	if (strcmp(argv[2], "read_full") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 1);
+	}
+
+	if (strcmp(argv[2], "read_data") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 0);
+	}
+
+	if (strcmp(argv[2], "read_range") == 0 || strcmp(argv[2], "read_range_full") == 0) {
+		if (argc != 6) goto usage;
+		if (strtoll(argv[4], NULL, 0) <= 0) {
+			printf("length must be > 0\n");
+			return -1;
+		}
+		return read_range(strtoll(argv[3], NULL, 0), strtoll(argv[4], NULL, 0), argv[5], argv[2][10] == '_');
+	}
+
+	if (strcmp(argv[2], "read_part") == 0) {
+		if (argc != 6) goto usage;
+		return read_part(argv[3], argv[4], argv[5]);
+	}
+
+	if (strcmp(argv[2], "ubi_dump") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of blocks must be > 0\n");
+			return -1;
+		}
+		if (strcmp(argv[5], "-") == 0) {
+			printf("ubi_dump needs a file name, not stdout\n");
+			return -1;
+		}
+		return ubi_dump(atoi(argv[3]), atoi(argv[4]), argv[5]);
+	}
+
+	if (strcmp(argv[2], "write_full") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return write_pages(atoi(argv[3]), atoi(argv[4]), argv[5]);
+	}
+
+	if (strcmp(argv[2], "calibrate") == 0) {
+		if (argc != 7) goto usage;
+		if (atoi(argv[4]) <= 0 || atoi(argv[5]) <= 0) {
+			printf("# of pages and # of passes must be > 0\n");
+			return -1;
+		}
+		return calibrate(atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), argv[6]);
+	}
+
+	if (strcmp(argv[2], "bench") == 0) {
+		if (argc != 4 && argc != 5) goto usage;
+		return bench(argv[1], atoi(argv[3]), argc == 5 ? atoi(argv[4]) : -1);
+	}
+
+	if (strcmp(argv[2], "oob_scan") == 0) {
+		if (argc != 5 && argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of blocks must be > 0\n");
+			return -1;
+		}
+		return oob_scan(atoi(argv[3]), atoi(argv[4]), argc == 6 ? argv[5] : NULL);
+	}
+
+	if (strcmp(argv[2], "erase_blocks") == 0) {
+		if (argc != 5) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of blocks must be > 0\n");
+			return -1;
+		}
+		return erase_blocks(atoi(argv[3]), atoi(argv[4]));
+	}
+
+	printf("unknown command '%s'\n", argv[2]);
+	goto usage;
+	return 0;
+}
+
+void error_msg(const char *msg)
+{
+	printf("%s\nBe sure to check wiring, and check that pressure is applied on both sides of 360 Clip\n" \
+		"sometimes it is required to move slightly the 360 Clip in case of a false contact\n", msg);
+}
+
+/* all sizes in bytes */
+struct nand_geometry {
+	unsigned int page_size, ras_size, orga, plane_number;
+	unsigned long block_size, plane_size, nand_size, nandras_size;
+	char serial_access[20];
+};
+
+/* decodes the 4th and 5th ID bytes */
+static void decode_geometry(const unsigned char id[5], nand_geometry *g)
+{
+	unsigned int bit;
+	unsigned fourthbits[8], fifthbits[8];
+
+	memset(g, 0, sizeof(*g));
+	for(bit = 0; bit < 8; ++bit)
+		fourthbits[bit] = (id[3] >> bit) & 1;
+	switch(fourthbits[1] * 10 + fourthbits[0]) {
+		case 00: g->page_size = 1024; break;
+		case 01: g->page_size = 2048; break;
+		case 10: g->page_size = 4096; break;
+		case 11: g->page_size = 8192; break;
+	}
+	switch(fourthbits[5] * 10 + fourthbits[4]) {
+		case 00: g->block_size = 64 * 1024; break;
+		case 01: g->block_size = 128 * 1024; break;
+		case 10: g->block_size = 256 * 1024; break;
+		case 11: g->block_size = 521 * 1024; break;
+	}
+	switch(fourthbits[2]) {
+		case 0: g->ras_size = 8; break; // for 512 bytes
+		case 1: g->ras_size = 16; break; // for 512 bytes
+	}
+	switch(fourthbits[6]) {
+		case 0: g->orga = 8; break; // bits
+		case 1: g->orga = 16; break; // bits
+	}
+	switch(fourthbits[7] * 10 + fourthbits[3]) {
+		case 00: strcpy(g->serial_access, "50ns/30ns minimum"); break;
+		case 10: strcpy(g->serial_access, "25ns minimum"); break;
+		case 01: strcpy(g->serial_access, "unknown (reserved)"); break;
+		case 11: strcpy(g->serial_access, "unknown (reserved)"); break;
+	}
+
+	for(bit = 0; bit < 8; ++bit)
+		fifthbits[bit] = (id[4] >> bit) & 1;
+	switch(fifthbits[3] * 10 + fifthbits[2]) {
+		case 00: g->plane_number = 1; break;
+		case 01: g->plane_number = 2; break;
+		case 10: g->plane_number = 4; break;
+		case 11: g->plane_number = 8; break;
+	}
+	switch(fifthbits[6] * 100 + fifthbits[5] * 10 + fifthbits[4]) {
+		case 100: g->plane_size = 64 / 8 * 1024 * 1024; break; // 64 megabits
+		case 001: g->plane_size = 128 / 8 * 1024 * 1024; break; // 128 megabits
+		case 010: g->plane_size = 256 / 8 * 1024 * 1024; break; // 256 megabits
+		case 011: g->plane_size = 512 / 8 * 1024 * 1024; break; // 512 megabits
+		case 000: g->plane_size = 1024 / 8 * 1024 * 1024; break; // 1 gigabit
+		case 101: g->plane_size = 2048 / 8 * 1024 * 1024; break; // 2 gigabits
+		case 110: g->plane_size = 4096 / 8 * 1024 * 1024; break; // 4 gigabits
+		case 111: g->plane_size = 8192 / 8 * 1024 * 1024; break; // 8 gigabits
+	}
+
+	g->nand_size = g->plane_number * g->plane_size;
+	g->nandras_size = g->nand_size + g->ras_size * g->nand_size / 512;
+}
+
+void print_id(unsigned char id[5])
+{
+	unsigned int i, bit;
+	nand_geometry g;
+	char maker[16], device[16];
+	unsigned thirdbits[8], fourthbits[8], fifthbits[8];
+
+	printf("Raw ID data: ");
+	for (i = 0; i < 5; i++)
+		printf("0x%02X ", id[i]);
+	printf("\n");
+
+ 	switch(id[0]) {
+ 		case 0xEC: {
+ 			strcpy(maker, "Samsung");
+ 			switch(id[1]) {
+ 				case 0xA1: strcpy(device, "K9F1G08R0A"); break;
+ 				case 0xD5: strcpy(device, "K9GAG08U0M"); break;
+ 				case 0xF1: strcpy(device, "K9F1G08U0A/B"); break;
+ 				default: strcpy(device, "unknown");
+ 			}
+ 			break;
+ 		}
+ 		case 0xAD: {
+ 			strcpy(maker, "Hynix");
+ 			switch(id[1]) {
+ 				case 0x73: strcpy(device, "HY27US08281A"); break;
+ 				case 0xD7: strcpy(device, "H27UBG8T2A"); break;
+ 				case 0xDA: strcpy(device, "HY27UF082G2B"); break;
+ 				case 0xDC: strcpy(device, "H27U4G8F2D"); break;
+ 				default: strcpy(device, "unknown");
+ 			}
+ 			break;
+ 		}
+ 		default: strcpy(maker, "unknown"); strcpy(device, "unknown");
+ 	}
+
+	decode_geometry(id, &g);
+	for(bit = 0; bit < 8; ++bit) {
+		thirdbits[bit] = (id[2] >> bit) & 1;
+		fourthbits[bit] = (id[3] >> bit) & 1;
+		fifthbits[bit] = (id[4] >> bit) & 1;
+	}
+
+	printf("\n");
+	printf("NAND manufacturer:  %s (0x%02X)\n", maker, id[0]);
+	printf("NAND model:         %s (0x%02X)\n", device, id[1]);
+	printf("\n");
+
+	printf("              I/O|7|6|5|4|3|2|1|0|\n");
+	printf("3rd ID data:     |");
+	for(bit = 8; bit--;)
+        printf("%u|", thirdbits[bit]);
+    printf(" (0x%02X)\n", id[2]);
+	printf("4th ID data:     |");
+	for(bit = 8; bit--;)
+        printf("%u|", fourthbits[bit]);
+    printf(" (0x%02X)\n", id[3]);
+	printf("5th ID data:     |");
+	for(bit = 8; bit--;)
+        printf("%u|", fifthbits[bit]);
+    printf(" (0x%02X)\n", id[4]);
+
+	printf("\n");
+	printf("Page size:          %d bytes\n", g.page_size);
+	printf("Block size:         %zd bytes\n", g.block_size);
+	printf("RAS (/512 bytes):   %d bytes\n", g.ras_size);
+	// printf("RAS (per page):  %d bytes\n", g.ras_size * g.page_size / 512);
+	// printf("RAS (per block): %d bytes\n", g.ras_size * g.block_size / 512);
+	printf("Organisation:       %d bit\n", g.orga);
+	printf("Serial access:      %s\n", g.serial_access);
+	printf("Number of planes:   %u\n", g.plane_number);
+	printf("Plane size:         %zd bytes\n", g.plane_size);
+	printf("\n");
+	printf("NAND size:          %zd MB\n", g.nand_size / (1024 * 1024));
+	printf("NAND size + RAS:    %zd MB\n", g.nandras_size / (1024 * 1024));
+	printf("Number of blocks:   %zd\n", g.nand_size / g.block_size);
+	printf("Number of pages:    %zd\n", g.nand_size / g.page_size);
+}
+
+/* one command latch cycle, the bus must point out */
+static INLINE void write_cmd(uint8_t cmd){
+	GPIO_SET_1(COMMAND_LATCH_ENABLE); tpause(T_CLS);
+	GPIO_SET_0(N_WRITE_ENABLE); upause();
+	GPIO_DATA8_OUT(cmd); tpause(T_WP);
+	GPIO_SET_1(N_WRITE_ENABLE); tpause(T_WH);
+	GPIO_SET_0(COMMAND_LATCH_ENABLE); upause();
+}
+
+/* n address latch cycles, the bus must point out */
+static INLINE void write_addr(const unsigned char *addr, int n)
+{
+	int i;
+
+	GPIO_SET_1(ADDRESS_LATCH_ENABLE); tpause(T_ALS);
+	for (i = 0; i < n; i++) {
+		GPIO_SET_0(N_WRITE_ENABLE); upause();
+		GPIO_DATA8_OUT(addr[i]); tpause(T_WP);
+		GPIO_SET_1(N_WRITE_ENABLE); tpause(T_WH);
+	}
+	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
+}
+
+/* n data input cycles, the bus must point out */
+static INLINE void write_data(const unsigned char *data, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		GPIO_SET_0(N_WRITE_ENABLE); upause();
+		GPIO_DATA8_OUT(data[i]); tpause(T_WP);
+		GPIO_SET_1(N_WRITE_ENABLE); tpause(T_WH);
+	}
+}
+
+/* clocks n bytes out of the chip, the bus must point in */
+static INLINE void clock_out(unsigned char *buf, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		GPIO_SET_0(N_READ_ENABLE); tpause(T_REA);
+		buf[i] = GPIO_DATA8_IN();
+		GPIO_SET_1(N_READ_ENABLE); tpause(T_RC);
+	}
+}
+
+static int read_id(unsigned char id[5])
+{
+	const unsigned char addr = 0x00;
+	unsigned char buf[5];
+
+	register_page = -1;
+	set_data_direction_out();
+	write_cmd(0x90); // Read ID
+	write_addr(&addr, 1);
+	tpause(T_WHR);
+	set_data_direction_in();
+	clock_out(buf, 5);
+
+	if (id != NULL)
+		memcpy(id, buf, 5);
+	else
+		print_id(buf);
+	if (buf[0] == buf[1] && buf[1] == buf[2] && buf[2] == buf[3] && buf[3] == buf[4]) {
+		error_msg("all five ID bytes are identical, this is not normal");
+		return -1;
+	}
+	return 0;
+}
+
+static INLINE int page_to_address(int page, int address_byte_index, int column = 0)
+{
+	switch(address_byte_index) {
+	//1st: A0 A1 A2 A3 A4 A5 A6 A7
+	case 0:
+		return column & 0xff;
+	//2nd: A8 A9 A10 A11 L (0) L (0) L (0) L (0)
+	case 1:
+		return (column >> 8) & 0x0f;
+	//3rd: A12 A13 A14 A15 A16 A17 A18 A19
+	case 2:
+		return page & 0xff;
+	//4th: A20 A21 A22 A23 A24 A25 A26 A27
+	case 3:
+		return (page >>  8) & 0xff;
+	//5th: A28 A29 A30 L (1) L (1) L (1) L (1) L (1)
+	case 4:
+		return (page >> 16) & 0xff;
+	default:
+		return 0;
+	}
+}
+
+static INLINE void page_address(int page, unsigned char addr[5], int column = 0)
+{
+	int i;
+
+	for (i = 0; i < 5; i++)
+		addr[i] = page_to_address(page, i, column);
+}
+
+/* output starts at column of the page, 0 is the main area, DATA_SIZE the spare */
+static INLINE int send_read_command(int page, int column = 0)
+{
+	unsigned char addr[5];
+
+	page_address(page, addr, column);
+	set_data_direction_out();
+	write_cmd(0x00);
+	write_addr(addr, 5);
+	write_cmd(0x30);
+	tpause(T_WB);
+
+	return 0;
+}
+
+/* confirm is 10h (program) or 15h (cache program) */
+static INLINE int send_write_command(int page, unsigned char data[PAGE_SIZE], uint8_t confirm = 0x10)
+{
+	unsigned char addr[5];
+
+	register_page = -1;
+	page_address(page, addr);
+	set_data_direction_out();
+	write_cmd(0x80);
+	write_addr(addr, 5);
+	tpause(T_ADL);
+	prof_lap(PH_CMD);
+
+	write_data(data, PAGE_SIZE);
+	prof_lap(PH_DATA);
+
+	write_cmd(confirm);
+	tpause(T_WB);
+
+	return 0;
+}
+
+static INLINE int send_eraseblock_command(int block)
+{
+	unsigned char addr[5];
+
+	register_page = -1;
+	page_address(block, addr);
+	set_data_direction_out();
+	write_cmd(0x60);
+	write_addr(addr + 2, 3); // row address only
+	write_cmd(0xD0);
+	tpause(T_WB);
+
+	return 0;
+}
+
+/* status register bits */
+#define SR_FAIL		0x01	// last operation failed
+#define SR_FAILC	0x02	// the operation before it failed (cache program)
+#define SR_ARDY		0x20	// array idle
+#define SR_RDY		0x40	// ready for the next command
+#define SR_WP		0x80	// not write protected
+
+static INLINE unsigned char read_status_register(void)
+{
+	unsigned char data;
+
+	set_data_direction_out();
+	write_cmd(0x70);
+	tpause(T_WHR);
+	set_data_direction_in();
+	clock_out(&data, 1);
+
+	// printf("Status data = %d\n", data);
+
+	return data;
+}
+
+static INLINE int read_status()
+{
+	return read_status_register() & SR_FAIL; // I/O0=0 success , I/O0=1 error
+}
+
+/* keeps reading the status register until all bits in mask are set */
+static INLINE unsigned char wait_status(unsigned char mask)
+{
+	unsigned char sr;
+
+	while (((sr = read_status_register()) & mask) != mask)
+		;
+	return sr;
+}
+
+static INLINE void wait_ready(void)
+{
+	while (GPIO_READ(N_READ_BUSY) == 0)
+		;
+}
+
+/* loads a page into the data register and clocks all of it out */
+static INLINE void read_page(int page, unsigned char *buf)
+{
+	send_read_command(page);
+	prof_lap(PH_CMD);
+	wait_ready();
+	prof_lap(PH_BUSY);
+	set_data_direction_in();
+	clock_out(buf, PAGE_SIZE);
+	register_page = page;
+	prof_lap(PH_DATA);
+}
+
+/* points the data output back at column of the register last read (05h-E0h) */
+static INLINE void change_read_column(int column)
+{
+	const unsigned char addr[2] = { (unsigned char)(column & 0xff), (unsigned char)(column >> 8) };
+
+	set_data_direction_out();
+	write_cmd(0x05);
+	write_addr(addr, 2);
+	write_cmd(0xE0);
+	tpause(T_WHR); // tCCS
+	set_data_direction_in();
+}
+
+/* ends an open 31h sequence and lets the array go idle */
+static INLINE void cache_read_end(void)
+{
+	if (cache.next_read < 0)
+		return;
+	set_data_direction_out();
+	write_cmd(0x3F);
+	tpause(T_WB);
+	wait_ready();
+	wait_status(SR_RDY | SR_ARDY);
+	cache.next_read = -1;
+}
+
+static INLINE void cache_read_page(int page, int last_page, unsigned char *buf)
+{
+	int restart = page != cache.next_read;
+
+	if (restart) {
+		cache_read_end();
+		send_read_command(page);
+		wait_ready();
+	}
+	if (restart && page == last_page) {
+		prof_lap(PH_CMD); // single page, the page register is already there
+	} else {
+		set_data_direction_out();
+		write_cmd(page < last_page ? 0x31 : 0x3F);
+		tpause(T_WB);
+		prof_lap(PH_CMD);
+		wait_ready();
+	}
+	prof_lap(PH_BUSY);
+	cache.next_read = page < last_page ? page + 1 : -1;
+	set_data_direction_in();
+	clock_out(buf, PAGE_SIZE);
+	register_page = page;
+	prof_lap(PH_DATA);
+}
+
+/* drops --planes on single plane parts */
+static void planes_setup(const unsigned char id[5])
+{
+	nand_geometry g;
+	int i;
+
+	if (!planes.enabled)
+		return;
+	decode_geometry(id, &g);
+	if (g.plane_number < 2) {
+		printf("--planes: the ID reports a single plane, using one-plane commands\n");
+		planes.enabled = 0;
+	}
+	for (i = 0; i < PAGES_PER_BLOCK; i++)
+		planes.stash_page[0][i] = planes.stash_page[1][i] = -1;
+}
+
+/* whether page (in an even block) has its partner page up to last_page */
+static INLINE int plane_pair(int page, int last_page)
+{
+	return planes.enabled && !((page / PAGES_PER_BLOCK) & 1) && page + PAGES_PER_BLOCK <= last_page;
+}
+
+static INLINE int send_plane_erase_command(int page)
+{
+	unsigned char addr[5];
+
+	register_page = -1;
+	set_data_direction_out();
+	page_address(page, addr);
+	write_cmd(0x60);
+	write_addr(addr + 2, 3);
+	page_address(page + PAGES_PER_BLOCK, addr);
+	write_cmd(0x60);
+	write_addr(addr + 2, 3);
+	write_cmd(0xD0);
+	tpause(T_WB);
+
+	return 0;
+}
+
+static INLINE int send_plane_write_command(int page, unsigned char data[PAGE_SIZE], unsigned char data2[PAGE_SIZE])
+{
+	unsigned char addr[5];
+
+	send_write_command(page, data, 0x11);
+	wait_ready(); // tDBSY
+
+	page_address(page + PAGES_PER_BLOCK, addr);
+	set_data_direction_out();
+	write_cmd(0x81);
+	write_addr(addr, 5);
+	tpause(T_ADL);
+	prof_lap(PH_CMD);
+
+	write_data(data2, PAGE_SIZE);
+	prof_lap(PH_DATA);
+
+	write_cmd(0x10);
+	tpause(T_WB);
+
+	return 0;
+}
+
+/* clocks out the page register of the plane page belongs to */
+static INLINE void plane_output(int page, unsigned char *buf)
+{
+	unsigned char addr[5];
+
+	page_address(page, addr);
+	set_data_direction_out();
+	write_cmd(0x00);
+	write_addr(addr, 5);
+	write_cmd(0x05);
+	write_addr(addr, 2);
+	write_cmd(0xE0);
+	tpause(T_WHR); // tCCS
+	set_data_direction_in();
+	clock_out(buf, PAGE_SIZE);
+}
+
+/*
+ * read_page() for --planes: returns 0 if page is neither half of a pair,
+ * otherwise page ends up in buf (the partner of an even page in stash).
+ */
+static int plane_read_page(int page, int last_page, int copy, unsigned char *buf)
+{
+	unsigned char addr[5];
+	int offset = page % PAGES_PER_BLOCK;
+
+	if (!planes.enabled)
+		return 0;
+	register_page = -1; // the output register depends on the plane selected last
+	if (planes.stash_page[copy][offset] == page) {
+		planes.stash_page[copy][offset] = -1;
+		memcpy(buf, planes.stash[copy][offset], PAGE_SIZE);
+		prof_lap(PH_DATA);
+		return 1;
+	}
+	if (!plane_pair(page, last_page))
+		return 0;
+
+	set_data_direction_out();
+	page_address(page, addr);
+	write_cmd(0x60);
+	write_addr(addr + 2, 3);
+	page_address(page + PAGES_PER_BLOCK, addr);
+	write_cmd(0x60);
+	write_addr(addr + 2, 3);
+	write_cmd(0x30);
+	tpause(T_WB);
+	prof_lap(PH_CMD);
+	wait_ready();
+	prof_lap(PH_BUSY);
+	plane_output(page, buf);
+	plane_output(page + PAGES_PER_BLOCK, planes.stash[copy][offset]);
+	planes.stash_page[copy][offset] = page + PAGES_PER_BLOCK;
+	prof_lap(PH_DATA);
+	return 1;
+}
+
+/* clocks the cache register out once more, from column 0 */
+static INLINE void cache_reread_page(unsigned char *buf)
+{
+	change_read_column(0);
+	prof_lap(PH_CMD);
+	clock_out(buf, PAGE_SIZE);
+	prof_lap(PH_DATA);
+}
+
+/* takes the reference for link_check() from the chip while it is idle */
+static void link_start(const unsigned char id[5])
+{
+	unsigned char sr;
+
+	memcpy(link_health.id, id, 5);
+	do { // two reads that agree
+		sr = read_status_register() & LINK_STATUS_MASK;
+		link_health.status = read_status_register() & LINK_STATUS_MASK;
+	} while (sr != link_health.status);
+	link_health.last = monotonic_ns();
+	link_health.probes = link_health.failures = 0;
+}
+
+static int link_probe(void)
+{
+	unsigned char id[5];
+
+	link_health.probes++;
+	if (link_health.probe == PROBE_STATUS)
+		return (read_status_register() & LINK_STATUS_MASK) == link_health.status;
+	read_id(id);
+	return memcmp(id, link_health.id, 5) == 0;
+}
+
+/* first_in_block: the next operation starts a block; retry: it repeats a failed one */
+static void link_check(int first_in_block, int retry)
+{
+	long long now;
+
+	switch (link_health.mode) {
+	case LINK_BLOCK:
+		if (!first_in_block && !retry)
+			return;
+		break;
+	case LINK_INTERVAL:
+		now = monotonic_ns();
+		if (!retry && now - link_health.last < link_health.interval_ns)
+			return;
+		link_health.last = now;
+		break;
+	case LINK_ERROR:
+		if (!retry)
+			return;
+		break;
+	}
+	while (!link_probe()) {
+		link_health.failures++;
+		printf(link_health.probe == PROBE_ID ? "\nNAND ID has changed! retrying" : "\nNAND status has changed! retrying");
+	}
+}
+
+static void link_report(void)
+{
+	if (link_health.failures || link_health.mode != LINK_PAGE || link_health.probe != PROBE_ID)
+		printf("Link checks: %ld probes, %ld failed\n", link_health.probes, link_health.failures);
+}
+
+#define VOTE_SAMPLES	5	// the two page copies plus three re-clocks
+#define VOTE_GAP	8	// differences closer than this share one 05h-E0h
+
+static struct {
+	long pages, bytes;
+} vote;
+
+/*
+ * Settles a page whose two copies differ without another array read: only
+ * the spans that differ are clocked out of the register again with 05h-E0h,
+ * and each byte in them is decided by majority over VOTE_SAMPLES samples.
+ * Returns -1 if the register no longer holds the page or a byte has no
+ * majority, the caller then re-reads the whole page as before.
+ */
+static int vote_page(int page, unsigned char *buf, FILE *badlog)
+{
+	unsigned char sample[VOTE_SAMPLES - 2][PAGE_SIZE];
+	unsigned char v[VOTE_SAMPLES];
+	int start, end, i, j, k, count, best, spans = 0, bytes = 0;
+
+	if (register_page != page)
+		return -1;
+	for (start = 0; start < PAGE_SIZE; start = end) {
+		while (start < PAGE_SIZE && buf[start] == buf[PAGE_SIZE + start])
+			start++;
+		if (start == PAGE_SIZE)
+			break;
+		for (end = start + 1, i = end; i < PAGE_SIZE && i - end < VOTE_GAP; i++)
+			if (buf[i] != buf[PAGE_SIZE + i])
+				end = i + 1;
+
+		for (k = 0; k < VOTE_SAMPLES - 2; k++) {
+			change_read_column(start);
+			clock_out(sample[k] + start, end - start);
+		}
+		prof_lap(PH_DATA);
+
+		for (i = start; i < end; i++) {
+			v[0] = buf[i];
+			v[1] = buf[PAGE_SIZE + i];
+			for (k = 0; k < VOTE_SAMPLES - 2; k++)
+				v[k + 2] = sample[k][i];
+			for (best = 0, j = 0; j < VOTE_SAMPLES && best <= VOTE_SAMPLES / 2; j++) {
+				for (count = 0, k = 0; k < VOTE_SAMPLES; k++)
+					count += v[k] == v[j];
+				if (count > best) {
+					best = count;
+					buf[i] = v[j];
+				}
+			}
+			if (best <= VOTE_SAMPLES / 2)
+				return -1;
+			if (best < VOTE_SAMPLES)
+				bytes++;
+		}
+		spans++;
+	}
+	vote.pages++;
+	vote.bytes += bytes;
+	fprintf(badlog, "Page %d: %d bytes in %d spans settled by a %d sample vote\n", page, bytes, spans, VOTE_SAMPLES);
+	return 0;
+}
+
+static int out_flush(void)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < out.fill) {
+		n = write(out.fd, out.batch + done, out.fill - done);
+		if (n < 0) {
+			perror("write output");
+			return -1;
+		}
+		done += n;
+	}
+	out.fill = 0;
+	return 0;
+}
+
+/*
+ * opens the dump for size bytes, stdout is already set up by out_stdout().
+ * A non-zero start keeps the first start bytes of an existing file and
+ * carries on after them (--resume).
+ */
+static int out_open(const char *outfile, size_t size, size_t start)
+{
+	int fd, mode = out.mode, trunc = start ? 0 : O_TRUNC;
+
+	out.size = size;
+	out.pos = start;
+	out.fill = 0;
+	if (mode == OUT_STDIO) {
+		if ((out.f = fopen(outfile, start ? "r+" : "w+")) == NULL) {
+			perror("fopen output file");
+			return -1;
+		}
+		if (start && fseeko(out.f, start, SEEK_SET) < 0) {
+			perror("fseek output file");
+			return -1;
+		}
+		return 0;
+	}
+	if (mode == OUT_MMAP || mode == OUT_DIRECT) {
+		fd = open(outfile, O_RDWR | O_CREAT | trunc | (mode == OUT_DIRECT ? O_DIRECT : 0), 0644);
+		if (fd < 0 && mode == OUT_DIRECT && errno == EINVAL) {
+			printf("%s does not support O_DIRECT, writing through the page cache\n", outfile);
+			fd = open(outfile, O_RDWR | O_CREAT | trunc, 0644);
+		}
+		if (fd < 0) {
+			perror("open output file");
+			return -1;
+		}
+		if (start && lseek(fd, start, SEEK_SET) < 0) {
+			perror("lseek output file");
+			return -1;
+		}
+		// reserve the blocks now rather than while the bus is running
+		if ((errno = posix_fallocate(fd, 0, size)) != 0 && ftruncate(fd, size) < 0) {
+			perror("fallocate output file");
+			return -1;
+		}
+		out.fd = fd;
+	}
+	if (mode == OUT_MMAP) {
+		if (size == 0)
+			return 0;
+		out.map = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, 0);
+		if (out.map == MAP_FAILED) {
+			perror("mmap output file");
+			return -1;
+		}
+		madvise(out.map, size, MADV_SEQUENTIAL);
+		return 0;
+	}
+	if (posix_memalign((void **)&out.batch, 4096, OUT_BATCH) != 0) {
+		perror("posix_memalign");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * makes everything written so far durable. In direct mode the batch is
+ * written out early, so pos has to be a multiple of 4096 here.
+ */
+static int out_sync(void)
+{
+	int ret = 0;
+
+	switch (out.mode) {
+	case OUT_STDIO:
+		if (fflush(out.f) != 0 || fdatasync(fileno(out.f)) < 0)
+			ret = -1;
+		break;
+	case OUT_MMAP:
+		if (out.map && msync(out.map, out.pos, MS_SYNC) < 0)
+			ret = -1;
+		break;
+	case OUT_DIRECT:
+		if (out_flush() < 0 || fdatasync(out.fd) < 0)
+			ret = -1;
+		break;
+	}
+	if (ret < 0)
+		perror("sync output file");
+	return ret;
+}
+
+/* appends one page (or its data area) to the dump */
+static int out_write(const unsigned char *buf, size_t len)
+{
+	size_t n;
+
+	switch (out.mode) {
+	case OUT_STDIO:
+		if (fwrite(buf, len, 1, out.f) != 1) {
+			perror("fwrite");
+			return -1;
+		}
+		break;
+	case OUT_MMAP:
+		memcpy(out.map + out.pos, buf, len);
+		break;
+	default:
+		while (len) {
+			n = OUT_BATCH - out.fill < len ? OUT_BATCH - out.fill : len;
+			memcpy(out.batch + out.fill, buf, n);
+			out.fill += n;
+			buf += n;
+			len -= n;
+			out.pos += n;
+			if (out.fill == OUT_BATCH && out_flush() < 0)
+				return -1;
+		}
+		return 0;
+	}
+	out.pos += len;
+	return 0;
+}
+
+static int out_close(void)
+{
+	int ret = 0;
+
+	switch (out.mode) {
+	case OUT_STDIO:
+		if (fclose(out.f) != 0)
+			ret = -1;
+		break;
+	case OUT_MMAP:
+		if (out.map && munmap(out.map, out.size) < 0)
+			ret = -1;
+		out.map = NULL;
+		if (ftruncate(out.fd, out.pos) < 0 || close(out.fd) < 0)
+			ret = -1;
+		break;
+	default:
+		// the tail is not a multiple of the O_DIRECT alignment
+		if (out.mode == OUT_DIRECT && out.fill % 4096)
+			fcntl(out.fd, F_SETFL, fcntl(out.fd, F_GETFL) & ~O_DIRECT);
+		if (out_flush() < 0)
+			ret = -1;
+		if (out.mode == OUT_DIRECT && ftruncate(out.fd, out.pos) < 0)
+			ret = -1;
+		if (close(out.fd) < 0)
+			ret = -1;
+		free(out.batch);
+		out.batch = NULL;
+	}
+	if (ret < 0)
+		perror("close output file");
+	return ret;
+}
+
+static uint32_t crc32_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++)
+			c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+static uint32_t crc32_buf(const unsigned char *p, size_t n)
+{
+	uint32_t c = 0xFFFFFFFF;
+
+	while (n--)
+		c = crc32_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+static INLINE int page_erased(const unsigned char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < PAGE_SIZE; i++)
+		if (buf[i] != 0xFF)
+			return 0;
+	return 1;
+}
+
+/* largest container for pages, for out_open() */
+static size_t dump_size(int pages)
+{
+	return sizeof(dump_header) + (size_t)pages * (PAGE_SIZE + sizeof(dump_page)) + sizeof(dump_trailer);
+}
+
+/* writes the header, once the ID is known */
+static int dump_start(const unsigned char id[5], int first_page, int pages)
+{
+	dump_header h;
+	nand_geometry g;
+	int t;
+
+	crc32_init();
+	if ((dump.index = (dump_page *)calloc(pages, sizeof(dump_page))) == NULL) {
+		perror("calloc dump index");
+		return -1;
+	}
+	dump.pages = pages;
+	dump.count = 0;
+	dump.erased = dump.bad = dump.retried = dump.voted = 0;
+
+	decode_geometry(id, &g);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DUMP_MAGIC, 8);
+	h.version = DUMP_VERSION;
+	h.header_size = sizeof(h);
+	memcpy(h.id, id, 5);
+	h.page_size = PAGE_SIZE;
+	h.pages_per_block = PAGES_PER_BLOCK;
+	h.data_size = g.page_size;
+	h.spare_per_512 = g.ras_size;
+	h.block_size = g.block_size;
+	h.planes = g.plane_number;
+	h.nand_size = g.nand_size;
+	h.first_page = first_page;
+	h.pages = pages;
+	h.timing_uniform = timing_uniform;
+	h.delay = delay;
+	for (t = 0; t < T_COUNT; t++)
+		h.timing_ns[t] = timing_ns[t];
+	return out_write((const unsigned char *)&h, sizeof(h));
+}
+
+/* hands one read_full page to the container, or straight to the output */
+static int dump_write(const unsigned char *buf, size_t len, int flags, int retries)
+{
+	dump_page *p;
+
+	if (!dump.enabled)
+		return out_write(buf, len);
+	p = &dump.index[dump.count++];
+	p->crc = crc32_buf(buf, PAGE_SIZE);
+	p->retries = retries > 255 ? 255 : retries;
+	if (page_erased(buf)) {
+		flags |= DUMP_ERASED;
+		dump.erased++;
+	} else {
+		p->offset = out.pos;
+	}
+	p->flags = flags;
+	dump.bad += !!(flags & DUMP_BAD);
+	dump.retried += !!(flags & DUMP_RETRIED);
+	dump.voted += !!(flags & DUMP_VOTED);
+	return p->offset ? out_write(buf, PAGE_SIZE) : 0;
+}
+
+/* writes the index and the trailer */
+static int dump_finish(void)
+{
+	dump_trailer t;
+
+	t.index_offset = out.pos;
+	t.pages = dump.count;
+	t.index_crc = crc32_buf((const unsigned char *)dump.index, dump.count * sizeof(dump_page));
+	memcpy(t.magic, DUMP_INDEX_MAGIC, 8);
+	if (out_write((const unsigned char *)dump.index, dump.count * sizeof(dump_page)) < 0 ||
+	    out_write((const unsigned char *)&t, sizeof(t)) < 0)
+		return -1;
+	printf("\nContainer: %d pages, %ld erased left out, %ld retried, %ld voted, %ld bad, %zu bytes\n",
+		dump.count, dump.erased, dump.retried, dump.voted, dump.bad, out.pos);
+	free(dump.index);
+	dump.index = NULL;
+	return 0;
+}
+
+/*
+ * starts the journal for a command on [first, first + count), or with
+ * --resume reads it back. Returns the page (block) to start at. Only
+ * --resume needs the journal; a run that cannot create one goes on
+ * without (journal.f NULL).
+ */
+static int journal_open(const char *cmd, int first, int count, const char *file, int batch, int sync_out)
+{
+	char line[256], word[32];
+	int a, b;
+	unsigned int id[5];
+
+	snprintf(journal.path, sizeof(journal.path), "%s.journal", file ? file : cmd);
+	journal.next = journal.synced = first;
+	journal.bad = journal.have_id = 0;
+	journal.batch = batch;
+	journal.sync_out = sync_out;
+
+	if (journal.resume) {
+		if ((journal.f = fopen(journal.path, "r")) == NULL) {
+			perror(journal.path);
+			printf("nothing to resume\n");
+			return -1;
+		}
+		if (fgets(line, sizeof(line), journal.f) == NULL || sscanf(line, "%31s %d %d", word, &a, &b) != 3 ||
+		    strcmp(word, cmd) != 0 || a != first || b != count) {
+			printf("%s is not for %s %d %d\n", journal.path, cmd, first, count);
+			return -1;
+		}
+		while (fgets(line, sizeof(line), journal.f) != NULL) {
+			if (sscanf(line, "done %d", &a) == 1 && a >= first && a <= first + count) {
+				journal.next = journal.synced = a;
+			} else if (sscanf(line, "bad %d", &a) == 1) {
+				journal.bad++;
+			} else if (sscanf(line, "id %x %x %x %x %x", &id[0], &id[1], &id[2], &id[3], &id[4]) == 5) {
+				for (a = 0; a < 5; a++)
+					journal.id[a] = id[a];
+				journal.have_id = 1;
+			} else if (strncmp(line, "timing ", 7) == 0) {
+				line[strcspn(line, "\n")] = 0;
+				if (journal.timing && strcmp(line + 7, journal.timing) != 0)
+					printf("the interrupted run used a <delay> of %s, this one %s\n", line + 7, journal.timing);
+			}
+		}
+		fclose(journal.f);
+		printf("Resuming %s at %d of %d to %d", cmd, journal.next, first, first + count - 1);
+		if (journal.bad)
+			printf(", %d bad before", journal.bad);
+		printf("\n");
+		if ((journal.f = fopen(journal.path, "a")) == NULL) {
+			perror(journal.path);
+			return -1;
+		}
+		fprintf(journal.f, "timing %s\n", journal.timing ? journal.timing : "?");
+		return journal.next;
+	}
+
+	if ((journal.f = fopen(journal.path, "w")) == NULL) {
+		perror(journal.path);
+		printf("carrying on without a journal, this run cannot be resumed\n");
+		return first;
+	}
+	fprintf(journal.f, "%s %d %d\ntiming %s\n", cmd, first, count, journal.timing ? journal.timing : "?");
+	return first;
+}
+
+/* records the chip ID, or checks it against the interrupted run */
+static int journal_id(const unsigned char id[5])
+{
+	if (journal.f == NULL)
+		return 0;
+	if (journal.have_id) {
+		if (memcmp(id, journal.id, 5) != 0) {
+			printf("this is not the chip of the interrupted run: ID %02x %02x %02x %02x %02x in %s\n",
+				journal.id[0], journal.id[1], journal.id[2], journal.id[3], journal.id[4], journal.path);
+			return -1;
+		}
+		return 0;
+	}
+	fprintf(journal.f, "id %02x %02x %02x %02x %02x\n", id[0], id[1], id[2], id[3], id[4]);
+	fflush(journal.f);
+	return 0;
+}
+
+static void journal_sync(void)
+{
+	if (journal.sync_out && out_sync() < 0)
+		return; // keep the old mark, the pages will be done again
+	fprintf(journal.f, "done %d\n", journal.next);
+	fflush(journal.f);
+	fdatasync(fileno(journal.f));
+	journal.synced = journal.next;
+}
+
+/* every page (block) before next is done */
+static INLINE void journal_commit(int next)
+{
+	if (journal.f == NULL)
+		return;
+	journal.next = next;
+	if (next - journal.synced >= journal.batch)
+		journal_sync();
+}
+
+static INLINE void journal_bad(int n)
+{
+	if (journal.f != NULL)
+		fprintf(journal.f, "bad %d\n", n);
+}
+
+/* a completed command needs no journal any more */
+static void journal_close(void)
+{
+	if (journal.f == NULL)
+		return;
+	fclose(journal.f);
+	journal.f = NULL;
+	unlink(journal.path);
+}
+
+/* lock-free hand-off between the two --pipeline threads */
+static INLINE int ring_push(spsc_ring *r, int v)
+{
+	unsigned head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == PIPE_SLOTS)
+		return 0;
+	r->slot[head % PIPE_SLOTS] = v;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static INLINE int ring_pop(spsc_ring *r, int *v)
+{
+	unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return 0;
+	*v = r->slot[tail % PIPE_SLOTS];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* 32x32 GF(2) matrix times vector, as in zlib's crc32_combine() */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+/* CRC32 of a run of equally sized blocks from the CRC32 of each block */
+static uint32_t crc32_chain(const uint32_t *crc, long n, size_t len)
+{
+	uint32_t op[32], odd[32], even[32], sum;
+	long i;
+	int k;
+
+	// op = append len zero bytes
+	odd[0] = 0xEDB88320;
+	for (k = 1; k < 32; k++)
+		odd[k] = 1u << (k - 1);
+	gf2_square(even, odd); // 2 zero bits
+	gf2_square(odd, even); // 4 zero bits
+	for (k = 0; k < 32; k++)
+		op[k] = 1u << k;
+	do {
+		gf2_square(even, odd);
+		if (len & 1)
+			for (k = 0; k < 32; k++)
+				op[k] = gf2_times(even, op[k]);
+		len >>= 1;
+		if (!len)
+			break;
+		gf2_square(odd, even);
+		if (len & 1)
+			for (k = 0; k < 32; k++)
+				op[k] = gf2_times(odd, op[k]);
+		len >>= 1;
+	} while (len);
+
+	for (sum = 0, i = 0; i < n; i++)
+		sum = gf2_times(op, sum) ^ crc[i];
+	return sum;
+}
+
+static void pipe_progress(int page, long finished)
+{
+	printf("Reading page n° %d in block n° %d (page %ld of %d), %ld%%\r", page, page / PAGES_PER_BLOCK,
+		finished, pipeline.pages, 100 * finished / pipeline.pages);
+	fflush(stdout);
+}
+
+/* output thread: verify, hash, write, report */
+static void *pipe_output(void *arg)
+{
+	pipe_slot *s;
+	long finished = 0;
+	long long last_progress = 0, now;
+	int i, ok;
+
+	(void)arg;
+	while (finished < pipeline.pages) {
+		if (!ring_pop(&pipeline.full, &i)) {
+			sched_yield();
+			continue;
+		}
+		s = &pipeline.slots[i];
+		if (s->copies == 1) {
+			if (!ecc_verified(s->buf)) {
+				s->copies = 2; // fall back to two reads, not a failed attempt
+				while (!ring_push(&pipeline.retry, i))
+					sched_yield();
+				continue;
+			}
+			ok = 1;
+		} else {
+			ok = memcmp(s->buf, s->buf + PAGE_SIZE, PAGE_SIZE) == 0;
+		}
+		if (!ok) {
+			if (s->attempts < 5) {
+				printf("\nPage %d failed to read correctly! retrying\n", s->page);
+				s->attempts++;
+				while (!ring_push(&pipeline.retry, i))
+					sched_yield();
+				continue;
+			}
+			printf("\nPage %d: too many retries. Perhaps bad block?\n", s->page);
+			fprintf(pipeline.badlog, "Page %d seems to be bad\n", s->page);
+			journal_bad(s->page);
+			pipeline.bad++;
+			s->flags = DUMP_BAD;
+		}
+
+		pipeline.held[s->page % PIPE_SLOTS] = i + 1;
+		// write out every page that is now next in line
+		while ((i = pipeline.held[(pipeline.first + finished) % PIPE_SLOTS]) != 0) {
+			pipeline.held[(pipeline.first + finished) % PIPE_SLOTS] = 0;
+			s = &pipeline.slots[i - 1];
+			dump_write(s->buf, pipeline.out_size, s->flags | (s->attempts ? DUMP_RETRIED : 0), s->attempts);
+			journal_commit(s->page + 1);
+			pipeline.crc[s->page - pipeline.first] = crc32_buf(s->buf, pipeline.out_size);
+			finished++;
+			now = monotonic_ns();
+			if (now - last_progress > 100000000LL || finished == pipeline.pages) {
+				pipe_progress(s->page, finished);
+				last_progress = now;
+			}
+			while (!ring_push(&pipeline.free, i - 1))
+				sched_yield();
+			if (finished == pipeline.pages)
+				break;
+		}
+	}
+	__atomic_store_n(&pipeline.done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * bus thread side of one slot. With --cache a retry, or the second read the
+ * ECC asked for, is a page the 31h sequence has gone past: it ends the
+ * sequence and is read with 00h-30h, the next new page starts a new one.
+ */
+static void pipe_fetch(pipe_slot *s, int last_page)
+{
+	unsigned char *buf = s->buf;
+	int n, again = s->attempts || (ecc.scheme != ECC_NONE && s->copies == 2);
+
+	for (n = 0; n < s->copies; n++) {
+		prof_lap(PH_OTHER);
+		if (cache.enabled) {
+			if (n) {
+				cache_reread_page(buf + PAGE_SIZE);
+			} else if (again) {
+				cache_read_end();
+				read_page(s->page, buf);
+			} else {
+				cache_read_page(s->page, last_page, buf);
+			}
+			continue;
+		}
+		link_check(s->page % PAGES_PER_BLOCK == 0 && !n, s->attempts > 0 && !n);
+		prof_lap(PH_IDCHECK);
+		if (s->attempts || !plane_read_page(s->page, last_page, n, buf + n * PAGE_SIZE))
+			read_page(s->page, buf + n * PAGE_SIZE);
+	}
+}
+
+static int pin_to_cpu(pthread_t thread, int cpu, int exclude)
+{
+	cpu_set_t set;
+	int i, ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	CPU_ZERO(&set);
+	for (i = 0; i < ncpu; i++)
+		if (exclude ? i != cpu : i == cpu)
+			CPU_SET(i, &set);
+	if (CPU_COUNT(&set) == 0)
+		return -1;
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+static int pipeline_read_pages(int first_page_number, int number_of_pages, int write_spare, FILE *badlog)
+{
+	pthread_t output;
+	pipe_slot *s;
+	int i, next = first_page_number, last = first_page_number + number_of_pages - 1;
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN), cpu = pipeline.cpu < 0 ? ncpu - 1 : pipeline.cpu;
+
+	pipeline.slots = (pipe_slot *)calloc(PIPE_SLOTS, sizeof(pipe_slot));
+	pipeline.crc = (uint32_t *)calloc(number_of_pages, sizeof(uint32_t));
+	if (pipeline.slots == NULL || pipeline.crc == NULL) {
+		perror("calloc pipeline");
+		return -1;
+	}
+	crc32_init();
+	pipeline.badlog = badlog;
+	pipeline.first = first_page_number;
+	pipeline.pages = number_of_pages;
+	pipeline.out_size = write_spare ? PAGE_SIZE : 512 * (PAGE_SIZE / 512);
+	for (i = 0; i < PIPE_SLOTS; i++)
+		ring_push(&pipeline.free, i);
+
+	if (pthread_create(&output, NULL, pipe_output, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	if (ncpu > 1) {
+		pin_to_cpu(output, cpu, 1);
+		if (pin_to_cpu(pthread_self(), cpu, 0) != 0)
+			printf("could not pin the bus thread to cpu %d\n", cpu);
+	}
+
+	while (!__atomic_load_n(&pipeline.done, __ATOMIC_ACQUIRE)) {
+		if (ring_pop(&pipeline.retry, &i)) {
+			s = &pipeline.slots[i];
+		} else if (next <= last && ring_pop(&pipeline.free, &i)) {
+			s = &pipeline.slots[i];
+			s->page = next++;
+			s->attempts = 0;
+			s->flags = 0;
+			s->copies = ecc.scheme == ECC_NONE ? 2 : 1;
+		} else {
+			continue; // output thread is behind, or only retries are left
+		}
+		pipe_fetch(s, last);
+		prof_lap(PH_DATA);
+		while (!ring_push(&pipeline.full, i))
+			;
+	}
+	pthread_join(output, NULL);
+	printf("\nCRC32 of the dump: %08x\n", crc32_chain(pipeline.crc, number_of_pages, pipeline.out_size));
+	if (pipeline.bad)
+		printf("%ld pages could not be read cleanly, see bad.log\n", pipeline.bad);
+	free(pipeline.crc);
+	free(pipeline.slots);
+	return 0;
+}
+
+
+static int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare)
+{
+	int page, page_no, block_no, page_nbr, percent, n, retry_count, flags = 0;
+	int resume_at = first_page_number;
+	size_t width = write_spare ? PAGE_SIZE : 512 * (PAGE_SIZE / 512);
+	unsigned char id[5];
+	unsigned char buf[PAGE_SIZE * 2];
+	FILE *badlog;
+	if (strcmp(outfile, "-") == 0 && out_stream() < 0)
+		return -1;
+	if (dump.enabled && !write_spare) {
+		printf("--container holds whole pages, use read_full\n");
+		return -1;
+	}
+	if (!dump.enabled && out.mode != OUT_STREAM) {
+		resume_at = journal_open(write_spare ? "read_full" : "read_data", first_page_number, number_of_pages, outfile, JOURNAL_BATCH, 1);
+		if (resume_at < 0)
+			return -1;
+	} else if (journal.resume) {
+		printf("--resume needs a plain output file, not --container or stdout\n");
+		return -1;
+	}
+	if (out_open(outfile, dump.enabled ? dump_size(number_of_pages) : number_of_pages * width,
+	    (resume_at - first_page_number) * width) < 0)
+		return -1;
+	number_of_pages -= resume_at - first_page_number;
+	first_page_number = resume_at;
+	if ((badlog = fopen("bad.log", journal.resume ? "a" : "w+")) == NULL) {
+		perror("fopen bad.log");
+		return -1;
+	}
+	if (pipeline.enabled && adapt.enabled) {
+		printf("--adaptive is not used with --pipeline\n");
+		adapt.enabled = 0;
+	}
+	if (adapt_start() < 0)
+		return -1;
+	if (GPIO_READ(N_READ_BUSY) == 0) {
+		error_msg("N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+		return -1;
+	}
+
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	planes_setup(id);
+	link_start(id);
+	if (journal_id(id) < 0)
+		return -1;
+	if (dump.enabled && dump_start(id, first_page_number, number_of_pages) < 0)
+		return -1;
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
+
+	printf("\nStart reading...\n");
+	clock_t start = clock();
+	prof_start();
+
+	if (number_of_pages == 0)
+		goto done; // the interrupted run got to the end
+	if (pipeline.enabled) {
+		if (pipeline_read_pages(first_page_number, number_of_pages, write_spare, badlog) < 0)
+			return -1;
+		goto done;
+	}
+
+	for (retry_count = 0, page = first_page_number*2; page < (first_page_number + number_of_pages)*2; page++) {
+
+	  retry_all:
+		page_no = page >> 1;
+
+		//printf("page = %d, n = %d\n",page, n);
+
+		if (page % 2 == 0 && retry_count == 0) {
+			// page_no = page / 2;
+			page_nbr = page_no - first_page_number + 1;
+			percent = (100 * page_nbr) / number_of_pages;
+			block_no = page_no / PAGES_PER_BLOCK;
+			printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\r", page_no, block_no, page_nbr, number_of_pages, percent);
+			fflush(stdout);
+		}
+		// else {
+		// 	printf("Reading the page again to ensure correct operation\n");
+		// }
+
+		n = PAGE_SIZE*(page & 1);
+		if (cache.enabled) {
+			// the second copy, and every retry, comes from the cache register
+			prof_lap(PH_OTHER);
+			if (n || retry_count)
+				cache_reread_page(buf + n);
+			else
+				cache_read_page(page_no, first_page_number + number_of_pages - 1, buf);
+		} else {
+			prof_lap(PH_OTHER);
+			link_check(page_no % PAGES_PER_BLOCK == 0 && !n, retry_count > 0 && !n);
+			prof_lap(PH_IDCHECK);
+			// retries go back to one-plane reads
+			if (retry_count || !plane_read_page(page_no, first_page_number + number_of_pages - 1, n != 0, buf + n))
+				read_page(page_no, buf + n);
+		}
+		if (!n) { // read the page again to ensure correct operation, bit 0 in page used for this purpose
+			// printf("RE LOOP    | page = %d, n = %d\n",page, n);
+			// printf("Reading the page n° %d again to ensure correct operation\n", page_no);
+			if (ecc.scheme == ECC_NONE || retry_count)
+				continue;
+			if (!ecc_verified(buf)) {
+				adapt_page(page_no, 2);
+				continue;
+			}
+			page |= 1; // the spare area ECC vouches for the single read
+		}
+
+		if (n && memcmp(buf, buf + PAGE_SIZE, PAGE_SIZE) != 0) {
+			prof_lap(PH_VERIFY);
+			adapt_page(page_no, 1);
+			if (vote_page(page_no, buf, badlog) == 0) {
+				flags |= DUMP_VOTED;
+				goto voted;
+			}
+			if (retry_count == 0) printf("\n");
+			if (retry_count < 5) {
+				printf("Page failed to read correctly! retrying\n");
+				retry_count++;
+				page = page & ~1;
+				goto retry_all;
+			}
+			printf("Too many retries. Perhaps bad block?\n");
+			fprintf(badlog, "Page %d seems to be bad\n", page_no);
+			journal_bad(page_no);
+			flags |= DUMP_BAD;
+		} else {
+			adapt_page(page_no, 0);
+		}
+	  voted:
+		prof_lap(PH_VERIFY);
+		if (dump_write(buf, width, flags | (retry_count ? DUMP_RETRIED : 0), retry_count) < 0)
+			return -1;
+		journal_commit(page_no + 1);
+		prof_lap(PH_FILEIO);
+		retry_count = 0;
+		flags = 0;
+	}
+  done:
+	if (dump.enabled && dump_finish() < 0)
+		return -1;
+	if (out_close() < 0)
+		return -1;
+	journal_close();
+	fcloseall();
+	clock_t end = clock();
+	printf("\n\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	adapt_finish();
+	ecc_report();
+	link_report();
+	if (vote.pages)
+		printf("Voting: %ld pages settled from the page register, %ld bytes voted (see bad.log)\n", vote.pages, vote.bytes);
+	prof_report("read");
+
+	//show cursor
+	// printf("\e[?25h");
+	// fflush(stdout) ;
+	return 0;
+}
+
+
+/*int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare)
+{
+	int page, block_no, page_nbr, percent, i;
+	unsigned char buf[PAGE_SIZE], id[5], id2[5];;
+	FILE *f = fopen(outfile, "w+");
+	if (f == NULL) {
+		perror("fopen output file");
+		return -1;
+	}
+	if (GPIO_READ(N_READ_BUSY) == 0) {
+		error_msg("N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+		return -1;
+	}
+
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
+
+	printf("\nStart reading...\n\n");
+	clock_t start = clock();
+
+
+	for (page = first_page_number; page < first_page_number + number_of_pages; page++) {
+
+		// printf("page = %d, n = %d\n",page, n);
+
+		// page_nbr = page - first_page_number + 1;
+		// percent = (100 * page_nbr) / number_of_pages;
+		// block_no = page / 64;
+		// printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\n", page, block_no, page_nbr, number_of_pages, percent);
+		printf("\nReading page n° %d\n", page);
+
+		send_read_command(page);
+		while (GPIO_READ(N_READ_BUSY) == 0) {
+			// printf("Busy\n");
+			shortpause();
+		}
+		set_data_direction_in();
+		for (i = 0; i < PAGE_SIZE; i++) {
+			GPIO_SET_0(N_READ_ENABLE);
+			shortpause();
+			buf[i] = GPIO_DATA8_IN(); //
+			shortpause();
+			GPIO_SET_1(N_READ_ENABLE);
+			shortpause();
+		}
+		if (write_spare) {
+			if (fwrite(buf, PAGE_SIZE, 1, f) != 1) {
+				perror("fwrite");
+				return -1;
+			}
+		}
+		else {
+			if (fwrite(buf, 512 * (PAGE_SIZE / 512), 1, f) != 1) {
+				perror("fwrite");
+				return -1;
+			}
+		}
+	}
+	fcloseall();
+	clock_t end = clock();
+	printf("\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+}
+*/
+/* programs one page with 80h-10h, retrying like write_pages does */
+static void program_page_retry(int page, unsigned char *buf, FILE *badlog)
+{
+	int retry_count;
+
+	printf("\nPage %d failed to write correctly! retrying\n", page);
+	for (retry_count = 0; retry_count < 5; retry_count++) {
+		send_write_command(page, buf);
+		wait_ready();
+		if (!read_status())
+			return;
+		printf("Failed to write page correctly! retrying\n");
+	}
+	printf("Too many retries. Perhaps bad block?\n");
+	journal_bad(page);
+	fprintf(badlog, "Page %d seems to be bad\n", page);
+}
+
+/*
+ * write_full/write_data with cache program (--cache). Once SR_RDY is back
+ * after 15h for page N, SR_FAILC is the result of page N-1; SR_FAIL only
+ * means something with SR_ARDY set, i.e. after the final 10h or after
+ * waiting for the array. By the time N-1 is known to have failed, page N
+ * is already in the array, so N-1 is only programmed again (with 10h,
+ * which restarts the pipeline) when N went to the next block; inside a
+ * block that would break the program order and N-1 is logged as bad.
+ */
+static void cache_write_pages(FILE *f, int first_page_number, int number_of_pages, FILE *badlog)
+{
+	unsigned char buf[2][PAGE_SIZE], sr, *cur;
+	int page, page_nbr, percent, failed_prev, pending = -1;
+	int last = first_page_number + number_of_pages - 1;
+
+	for (page = first_page_number; page <= last; page++) {
+		page_nbr = page - first_page_number + 1;
+		percent = (100 * page_nbr) / number_of_pages;
+		printf("Writing page n° %d in block n° %d (page %d of %d), %d%%\r", page, page / PAGES_PER_BLOCK, page_nbr, number_of_pages, percent);
+		fflush(stdout);
+
+		prof_lap(PH_OTHER);
+		cur = buf[page & 1];
+		fseek(f, page * PAGE_SIZE, SEEK_SET);
+		fread(cur, PAGE_SIZE, 1, f);
+		prof_lap(PH_FILEIO);
+
+		send_write_command(page, cur, page < last ? 0x15 : 0x10);
+		prof_lap(PH_CMD);
+		wait_ready();
+		sr = wait_status(page < last ? SR_RDY : SR_RDY | SR_ARDY);
+		prof_lap(PH_BUSY);
+
+		failed_prev = pending >= 0 && (sr & SR_FAILC);
+		if (failed_prev && page < last)
+			sr = wait_status(SR_RDY | SR_ARDY); // SR_FAIL is now this page's result
+		if (failed_prev && page % PAGES_PER_BLOCK == 0) {
+			program_page_retry(pending, buf[pending & 1], badlog);
+		} else if (failed_prev) {
+			printf("\nPage %d failed to write correctly, not retried after page %d\n", pending, page);
+			journal_bad(pending);
+			fprintf(badlog, "Page %d seems to be bad\n", pending);
+		}
+		if ((failed_prev || page == last) && (sr & SR_FAIL))
+			program_page_retry(page, cur, badlog);
+		pending = failed_prev ? -1 : page;
+		prof_lap(PH_CMD);
+		journal_commit(page == last ? last + 1 : pending >= 0 ? pending : page + 1);
+	}
+}
+
+/*
+ * write_full/write_data with two-plane program (--planes). Pages of an even
+ * block are programmed together with their partner in the odd block, which
+ * keeps the program order inside each block ascending. That takes an even
+ * block that starts inside the range: from an unaligned start the leading
+ * pages of the odd block have no partner and would come after the paired
+ * ones, so both blocks go one page at a time. 70h only has one FAIL bit
+ * for both planes, so both pages of a failed pair are retried.
+ */
+static INLINE int plane_write_pair(int page, int first_page, int last_page)
+{
+	return plane_pair(page, last_page) && page - page % PAGES_PER_BLOCK >= first_page;
+}
+
+static void plane_write_pages(FILE *f, int first_page_number, int number_of_pages, FILE *badlog)
+{
+	unsigned char buf[2][PAGE_SIZE];
+	int page, page_nbr, percent, pair;
+	int last = first_page_number + number_of_pages - 1;
+
+	for (page = first_page_number; page <= last; page++) {
+		if ((page / PAGES_PER_BLOCK) & 1 && plane_write_pair(page - PAGES_PER_BLOCK, first_page_number, last))
+			continue; // went with its pair
+		pair = plane_write_pair(page, first_page_number, last);
+		page_nbr = page - first_page_number + 1;
+		percent = (100 * page_nbr) / number_of_pages;
+		printf("Writing page n° %d in block n° %d (page %d of %d), %d%%\r", page, page / PAGES_PER_BLOCK, page_nbr, number_of_pages, percent);
+		fflush(stdout);
+
+		prof_lap(PH_OTHER);
+		fseek(f, page * PAGE_SIZE, SEEK_SET);
+		fread(buf[0], PAGE_SIZE, 1, f);
+		if (pair) {
+			fseek(f, (page + PAGES_PER_BLOCK) * PAGE_SIZE, SEEK_SET);
+			fread(buf[1], PAGE_SIZE, 1, f);
+		}
+		prof_lap(PH_FILEIO);
+
+		if (pair)
+			send_plane_write_command(page, buf[0], buf[1]);
+		else
+			send_write_command(page, buf[0]);
+		prof_lap(PH_CMD);
+		wait_ready();
+		prof_lap(PH_BUSY);
+		if (read_status()) {
+			program_page_retry(page, buf[0], badlog);
+			if (pair)
+				program_page_retry(page + PAGES_PER_BLOCK, buf[1], badlog);
+		}
+		prof_lap(PH_CMD);
+		// the odd block is complete with the last page of its pair
+		if (pair && page % PAGES_PER_BLOCK == PAGES_PER_BLOCK - 1)
+			journal_commit(page + PAGES_PER_BLOCK + 1);
+		else
+			journal_commit(page + 1);
+	}
+}
+
+/*
+ * --resume of a write: the pages after the last "done" mark may or may not
+ * have been programmed when the run stopped. Leading pages that read back
+ * as the input are done. After the first one that is not, pages that hold
+ * the input (the other plane of a --planes pair, or a page --cache had
+ * already sent) are kept in resumed and skipped by the single-page loop.
+ * Every other page of that stretch has to be erased, since a page must not
+ * be programmed twice.
+ */
+#define RESUME_WINDOW	(JOURNAL_BATCH + 2 * PAGES_PER_BLOCK) // --planes runs ahead by a block
+
+static struct {
+	int from, until;            // skip[] is for pages [from, until)
+	unsigned char skip[RESUME_WINDOW];
+} resumed;
+
+static int write_resume_check(FILE *f, int *first_page_number, int *number_of_pages)
+{
+	unsigned char chip[PAGE_SIZE], file[PAGE_SIZE];
+	int page, p, match, end = *first_page_number + *number_of_pages;
+	int window = journal.synced + RESUME_WINDOW < end ? journal.synced + RESUME_WINDOW : end;
+
+	for (page = *first_page_number, p = page; p < window; p++) {
+		read_page(p, chip);
+		fseek(f, p * PAGE_SIZE, SEEK_SET);
+		match = fread(file, PAGE_SIZE, 1, f) == 1 && memcmp(chip, file, PAGE_SIZE) == 0;
+		if (match && p == page) {
+			page++;
+		} else if (match) {
+			resumed.skip[p - page] = 1;
+			resumed.until = p + 1;
+		} else if (!page_erased(chip)) {
+			printf("page %d is neither the input nor erased, erase from block %d on and resume\n", p, page / PAGES_PER_BLOCK);
+			return -1;
+		}
+	}
+	resumed.from = page;
+	printf("%d pages after the journal mark were already programmed", page - *first_page_number);
+	if (resumed.until > page)
+		printf(", and some after page %d", page);
+	printf("\n");
+	*number_of_pages -= page - *first_page_number;
+	*first_page_number = page;
+	return 0;
+}
+
+static INLINE int write_pages(int first_page_number, int number_of_pages, char *infile)
+{
+	int page, block_no, page_nbr, percent, retry_count, resume_at, stop, plain_end;
+	unsigned char buf[PAGE_SIZE], id[5];
+
+	if ((resume_at = journal_open("write_full", first_page_number, number_of_pages, infile, JOURNAL_BATCH, 0)) < 0)
+		return -1;
+	number_of_pages -= resume_at - first_page_number;
+	first_page_number = resume_at;
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	planes_setup(id);
+	link_start(id);
+	if (journal_id(id) < 0)
+		return -1;
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
+
+	FILE *f = fopen(infile, "rb");
+	if (f == NULL) {
+		perror("fopen input file");
+		return -1;
+	}
+	FILE *badlog = fopen("bad.log", journal.resume ? "a" : "w+");
+	if (badlog == NULL) {
+		perror("fopen bad.log");
+		return -1;
+	}
+	if (journal.resume && write_resume_check(f, &first_page_number, &number_of_pages) < 0)
+		return -1;
+	stop = first_page_number + number_of_pages;
+	// pages left over from an interrupted run go one at a time
+	plain_end = planes.enabled || cache.enabled ? first_page_number : stop;
+	if (resumed.until > plain_end)
+		plain_end = resumed.until;
+
+	printf("\nStart writing...\n");
+	clock_t start = clock();
+	prof_start();
 
-	set_data_direction_out();
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0x00);
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+	// printf("first_page_number = %d\n", first_page_number);
+	// printf("number of pages = %d\n", number_of_pages);
 
-	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_0(N_WRITE_ENABLE);
-		shortpause();
+  fast:
+	if (planes.enabled && first_page_number == plain_end) {
+		plane_write_pages(f, first_page_number, number_of_pages, badlog);
+		goto done;
+	}
+	if (cache.enabled && first_page_number == plain_end) {
+		cache_write_pages(f, first_page_number, number_of_pages, badlog);
+		goto done;
+	}
 
+	for (retry_count = 0, page = first_page_number; page < plain_end; page++) {
+		if (page < resumed.until && resumed.skip[page - resumed.from]) {
+			journal_commit(page + 1);
+			continue;
+		}
 
-		// if (i < 2) {
-		// 	printf("Col Add%d = %d\n", i + 1, page_to_address(page, i));
-		// }
-		// else {
-		// 	printf("Row Add%d = %d\n", i - 1, page_to_address(page, i));
-		// }
+	  retry_all:
+
+		if (retry_count == 0) {
+			// page_no = page / 2;
+			page_nbr = page - first_page_number + 1;
+			percent = (100 * page_nbr) / number_of_pages;
+			block_no = page / PAGES_PER_BLOCK;
+			printf("Writing page n° %d in block n° %d (page %d of %d), %d%%\r", page, block_no, page_nbr, number_of_pages, percent);
+			fflush(stdout);
+		}
+
+		prof_lap(PH_OTHER);
+		fseek(f, page * PAGE_SIZE, SEEK_SET);
+		fread(buf, PAGE_SIZE, 1, f);
+		prof_lap(PH_FILEIO);
+
+		// printf("\nwriting page n°%d\n", page);
 
-		GPIO_DATA8_OUT(page_to_address(page, i));
-		shortpause();
-		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
+		link_check(page % PAGES_PER_BLOCK == 0, retry_count > 0);
+		prof_lap(PH_IDCHECK);
+		send_write_command(page, buf);
+		prof_lap(PH_CMD);
+		wait_ready();
+		prof_lap(PH_BUSY);
+		// read_status();
+		if (read_status()) {
+			prof_lap(PH_CMD);
+			if (retry_count == 0) printf("\n");
+			if (retry_count < 5) {
+				printf("Failed to write page correctly! retrying\n");
+				retry_count++;
+				goto retry_all;
+			}
+			printf("Too many retries. Perhaps bad block?\n");
+			journal_bad(page);
+			fprintf(badlog, "Page %d seems to be bad\n", page);
+			// retry_count = 0;
+		}
+		prof_lap(PH_CMD);
+		retry_count = 0;
+		journal_commit(page + 1);
 	}
-	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
-	shortpause();
-
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0x30);
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+	if (plain_end < stop) {
+		first_page_number = plain_end;
+		number_of_pages = stop - plain_end;
+		goto fast;
+	}
+
+  done:
+	journal_close();
 
+	fcloseall();
+	clock_t end = clock();
+	printf("\nWrite done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	link_report();
+	prof_report("write");
 	return 0;
 }
 
-static INLINE int send_write_command(int page, unsigned char data[PAGE_SIZE])
+static INLINE int erase_blocks(int first_block_number, int number_of_blocks)
 {
-	int i;
+	int block, block_nbr, percent, retry_count, paired, resume_at;
+	unsigned char id[5];
 
-	set_data_direction_out();
+	if ((resume_at = journal_open("erase_blocks", first_block_number, number_of_blocks, NULL, JOURNAL_BLOCKS, 0)) < 0)
+		return -1;
+	number_of_blocks -= resume_at - first_block_number;
+	first_block_number = resume_at;
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	planes_setup(id);
+	link_start(id);
+	if (journal_id(id) < 0)
+		return -1;
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0x80);
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+	printf("\nStart erasing...\n");
+	clock_t start = clock();
+	prof_start();
 
-	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_0(N_WRITE_ENABLE);
+	for (retry_count = 0, block = first_block_number; block < (first_block_number + number_of_blocks); block++) {
 
-		// if (i < 2) {
-		// 	printf("Col Add%d = %d\n", i + 1, page_to_address(page, i));
-		// }
-		// else {
-		// 	printf("Row Add%d = %d\n", i - 1, page_to_address(page, i));
-		// }
+	  retry_all:
+			
+		block_nbr = block - first_block_number + 1;
+		percent = (100 * block_nbr) / number_of_blocks;
 
-		GPIO_DATA8_OUT(page_to_address(page, i));
-		shortpause();
-		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
-	}
-	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
-	shortpause();
+		if (retry_count == 0) {
+			printf("Erasing block n° %d at adress 0x%02X (block %d of %d), %d%%\r", block, block * BLOCK_SIZE, block_nbr, number_of_blocks, percent);
+			fflush(stdout);
+			// printf("Block address : %d (0x%02X)\n", block * BLOCK_SIZE, block * BLOCK_SIZE);
+		}
 
-	for (i = 0; i < PAGE_SIZE; i++) {
-		GPIO_SET_0(N_WRITE_ENABLE);
-		shortpause();
-		GPIO_DATA8_OUT(data[i]); //
-		shortpause();
-		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
-	}
+		prof_lap(PH_OTHER);
+		link_check(1, retry_count > 0);
+		prof_lap(PH_IDCHECK);
+
+		// --planes: an even block and the next one at once, retries one at a time
+		paired = retry_count == 0 && plane_pair(block * PAGES_PER_BLOCK, (first_block_number + number_of_blocks) * PAGES_PER_BLOCK - 1);
+		if (paired)
+			send_plane_erase_command(block * PAGES_PER_BLOCK);
+		else
+			send_eraseblock_command(block * PAGES_PER_BLOCK);
+		prof_lap(PH_CMD);
+		wait_ready();
+		prof_lap(PH_BUSY);
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause(); GPIO_SET_0(N_WRITE_ENABLE);
-	GPIO_DATA8_OUT(0x10);
-	shortpause(); GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause(); GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+		if (read_status()) {
+			prof_lap(PH_CMD);
+			if (retry_count == 0) printf("\n");
+			if (retry_count < 5) {
+				printf("Failed to erase block correctly! retrying\n");
+				retry_count++;
+				goto retry_all;
+			}
+			printf("Too many retries. Perhaps bad block?\n");
+			journal_bad(block);
+			// retry_count = 0;
+		}
+		prof_lap(PH_CMD);
+		retry_count = 0;
+		if (paired)
+			block++;
+		journal_commit(block + 1);
+	}
+	journal_close();
 
+	clock_t end = clock();
+	printf("\nErasing done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	link_report();
+	prof_report("erase");
 	return 0;
 }
 
-static INLINE void write_cmd(uint8_t cmd){
-	GPIO_SET_1(COMMAND_LATCH_ENABLE); shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);	shortpause();
-
-	GPIO_DATA8_OUT(cmd); shortpause();
-	
-	GPIO_SET_1(N_WRITE_ENABLE);	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE); shortpause();
+/*
+ * read_range <byte offset> <length> <output file>: reads a byte range of
+ * the read_data layout (main areas only, the addresses MTD uses), and
+ * read_range_full the same in the read_full layout. The read command
+ * carries the column of the first byte wanted in each page, and only up
+ * to the last one wanted is clocked out, so partial first and last pages
+ * cost only their bytes and read_range never clocks a spare area. Each
+ * piece is read twice and compared, retrying like read_full.
+ */
+static INLINE void read_page_part(int page, int column, unsigned char *buf, int len)
+{
+	send_read_command(page, column);
+	prof_lap(PH_CMD);
+	wait_ready();
+	prof_lap(PH_BUSY);
+	set_data_direction_in();
+	clock_out(buf, len);
+	register_page = page;
+	prof_lap(PH_DATA);
 }
 
-static INLINE int send_eraseblock_command(int block)
+/* read_page_part() twice until both copies agree, -1 after 5 retries */
+static int read_page_checked(int page, int column, unsigned char *buf, int len, int check_link)
 {
-	int i;
-
-	set_data_direction_out();
-
-	GPIO_SET_1(COMMAND_LATCH_ENABLE); shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);	shortpause();
-	GPIO_DATA8_OUT(0x60); shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE); shortpause();
-
-	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	for (i = 2; i < 5; i++) {
-		GPIO_SET_0(N_WRITE_ENABLE);
-		shortpause();
-
-		// printf("Row Add%d = %d\n", i - 1, page_to_address(block, i));
+	unsigned char copy[PAGE_SIZE];
+	int retry_count;
+
+	for (retry_count = 0; ; retry_count++) {
+		prof_lap(PH_OTHER);
+		link_check(check_link, retry_count > 0);
+		prof_lap(PH_IDCHECK);
+		read_page_part(page, column, buf, len);
+		read_page_part(page, column, copy, len);
+		prof_lap(PH_DATA);
+		if (memcmp(buf, copy, len) == 0)
+			return 0;
+		prof_lap(PH_VERIFY);
+		if (retry_count == 5) {
+			printf("\nPage %d: too many retries. Perhaps bad block?\n", page);
+			return -1;
+		}
+	}
+}
 
-		GPIO_DATA8_OUT(page_to_address(block, i));
-		shortpause();
-		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
+/* length -1 is up to the end of the chip */
+static int read_range(long long offset, long long length, const char *outfile, int full)
+{
+	unsigned char id[5], buf[PAGE_SIZE];
+	int width = full ? PAGE_SIZE : DATA_SIZE;
+	int page, column, n, bad = 0;
+	long long done = 0, total;
+	nand_geometry g;
+	FILE *badlog;
+
+	if (strcmp(outfile, "-") == 0 && out_stream() < 0)
+		return -1;
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	link_start(id);
+	decode_geometry(id, &g);
+	total = (long long)(g.nand_size / g.page_size) * width;
+	if (length < 0)
+		length = total - offset;
+	if (offset < 0 || length <= 0 || offset + length > total) {
+		printf("range 0x%llx+0x%llx is outside the %lld bytes of the chip\n", offset, length, total);
+		return -1;
+	}
+	if (out_open(outfile, length, 0) < 0)
+		return -1;
+	if ((badlog = fopen("bad.log", "w+")) == NULL) {
+		perror("fopen bad.log");
+		return -1;
 	}
-	GPIO_SET_0(ADDRESS_LATCH_ENABLE); shortpause();
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE); shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE); shortpause();
-	GPIO_DATA8_OUT(0xD0); shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE); shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE); shortpause();
+	printf("\nReading 0x%llx bytes at 0x%llx...\n", length, offset);
+	long long start = monotonic_ns();
+	prof_start();
+
+	page = offset / width;
+	column = offset % width;
+	for (; done < length; page++, column = 0) {
+		n = width - column < length - done ? width - column : length - done;
+		printf("Reading page n° %d in block n° %d, %lld%%\r", page, page / PAGES_PER_BLOCK, 100 * (done + n) / length);
+		fflush(stdout);
+		if (read_page_checked(page, column, buf, n, page % PAGES_PER_BLOCK == 0 || done == 0) < 0) {
+			fprintf(badlog, "Page %d seems to be bad\n", page);
+			bad++;
+		}
+		prof_lap(PH_VERIFY);
+		if (out_write(buf, n) < 0)
+			return -1;
+		prof_lap(PH_FILEIO);
+		done += n;
+	}
+	if (out_close() < 0)
+		return -1;
+	fclose(badlog);
 
+	printf("\n\nReading done in %f seconds", (monotonic_ns() - start) / 1e9);
+	if (bad)
+		printf(", %d pages could not be read cleanly (see bad.log)", bad);
+	printf("\n");
+	link_report();
+	prof_report("read");
 	return 0;
 }
 
-static INLINE int read_status()
+/* a number with an optional k/m/g suffix, as in mtdparts */
+static long long mtd_number(const char **p)
 {
-	int data;
-	set_data_direction_out();
+	char *end;
+	long long n = strtoll(*p, &end, 0);
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE); shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE); shortpause();
-	GPIO_DATA8_OUT(0x70); shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE); shortpause();
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; end++; break;
+	case 'm': case 'M': n <<= 20; end++; break;
+	case 'g': case 'G': n <<= 30; end++; break;
+	}
+	*p = end;
+	return n;
+}
 
-	set_data_direction_in();
+/*
+ * read_part <mtdparts> <name> <output file>: read_range of one partition of
+ * an MTD partition table in the kernel's syntax,
+ *   [mtdparts=][<mtd-id>:]<size>[@<offset>](<name>)[ro],...
+ * where a size of - is the rest of the chip and a missing offset follows
+ * the previous partition.
+ */
+static int read_part(const char *mtdparts, const char *name, const char *outfile)
+{
+	const char *p = mtdparts, *colon;
+	long long size, offset = 0;
+	size_t len;
+
+	if (strncmp(p, "mtdparts=", 9) == 0)
+		p += 9;
+	if ((colon = strchr(p, ':')) != NULL && (strchr(p, '(') == NULL || colon < strchr(p, '(')))
+		p = colon + 1;
+	while (*p) {
+		if (*p == '-') {
+			size = -1;
+			p++;
+		} else {
+			size = mtd_number(&p);
+		}
+		if (*p == '@') {
+			p++;
+			offset = mtd_number(&p);
+		}
+		if (*p != '(' || strchr(p, ')') == NULL) {
+			printf("cannot parse the partition table at '%s'\n", p);
+			return -1;
+		}
+		len = strchr(p, ')') - p - 1;
+		if (len == strlen(name) && strncmp(p + 1, name, len) == 0) {
+			printf("partition %s: ", name);
+			if (size < 0)
+				printf("0x%llx to the end of the chip\n", offset);
+			else
+				printf("0x%llx bytes at 0x%llx\n", size, offset);
+			return read_range(offset, size, outfile, 0);
+		}
+		p += len + 2;
+		if (strncmp(p, "ro", 2) == 0)
+			p += 2;
+		if (*p == ',')
+			p++;
+		if (size < 0)
+			break;
+		offset += size;
+	}
+	printf("no partition named %s\n", name);
+	return -1;
+}
 
-	GPIO_SET_0(N_READ_ENABLE); shortpause();
-	data = GPIO_DATA8_IN(); shortpause();
-	GPIO_SET_1(N_READ_ENABLE); shortpause();
+/*
+ * ubi_dump <block #> <# of blocks> <output>: selective dump of a UBI area.
+ * Pass 1 reads the first two pages of every PEB and checks the CRCs of the
+ * EC header and the VID header found in them (a VID header further in is
+ * read on its own). That is enough to map the volumes' LEBs to PEBs: the
+ * copy with the highest sqnum wins, and the volume names come from the
+ * layout volume's table. Pass 2 reads the rest of the PEBs that hold a LEB,
+ * and of those whose headers are corrupt; free (EC header only), erased and
+ * bad PEBs are not read any further.
+ * The output is a read_full layout image of the range with the skipped
+ * pages written as FFh, so that write_full takes it back, or with
+ * --ubi-volumes one <output>_<name>.img per volume: its LEBs in order, data
+ * area only, unmapped LEBs as FFh. <output>.map lists what each PEB held.
+ */
+#define UBI_EC_MAGIC		0x55424923	// "UBI#"
+#define UBI_VID_MAGIC		0x55424921	// "UBI!"
+#define UBI_HDR_SIZE		64
+#define UBI_LAYOUT_VOLUME_ID	0x7FFFEFFF
+#define UBI_MAX_VOLUMES		128
+#define UBI_VTBL_RECORD_SIZE	172
+#define UBI_VID_STATIC		2
+
+enum { PEB_ERASED, PEB_BAD, PEB_FREE, PEB_USED, PEB_STALE, PEB_CORRUPT };
+
+struct ubi_peb {
+	int state;
+	unsigned ec;
+	int vid_offset, data_offset;
+	int vol_id, lnum, vol_type, data_size, used_ebs, data_pad;
+	unsigned long long sqnum;
+};
 
-	// printf("Status data = %d\n", data);
+static INLINE uint32_t ubi_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
 
-	return data & 1; // I/O0=0 success , I/O0=1 error
+/* UBI's CRC32 is seeded with ~0 like zlib's but has no final inversion */
+static INLINE int ubi_crc_ok(const unsigned char *p, size_t n, const unsigned char *crc)
+{
+	return (crc32_buf(p, n) ^ 0xFFFFFFFF) == ubi_be32(crc);
 }
 
+static INLINE int ubi_erased(const unsigned char *p, size_t n)
+{
+	while (n--)
+		if (*p++ != 0xFF)
+			return 0;
+	return 1;
+}
 
-static int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare)
+static int ubi_dump(int first_block_number, int number_of_blocks, const char *outfile)
 {
-	int page, page_no, block_no, page_nbr, percent, i, n, retry_count;
-	unsigned char id[5], id2[5];
-	unsigned char buf[PAGE_SIZE * 2];
-	FILE *badlog, *f = fopen(outfile, "w+");
-	if (f == NULL) {
-		perror("fopen output file");
+	unsigned char id[5], head[2][PAGE_SIZE], buf[PAGE_SIZE], vid[UBI_HDR_SIZE];
+	unsigned char vtbl[UBI_MAX_VOLUMES * UBI_VTBL_RECORD_SIZE];
+	char names[UBI_MAX_VOLUMES][128], path[1024];
+	int reserved[UBI_MAX_VOLUMES], vtbl_ok = 0;
+	int i, j, n, page, p, first_page, fd = -1, pages_read = 0, full_pebs = 0, bad = 0;
+	ubi_peb *peb, *q;
+	long long start;
+	double seconds;
+	FILE *map, *badlog, *f;
+
+	if (read_id(id) < 0)
 		return -1;
-	}
-	if ((badlog = fopen("bad.log", "w+")) == NULL) {
-		perror("fopen bad.log");
+	print_id(id);
+	link_start(id);
+	crc32_init();
+	if ((peb = (ubi_peb *)calloc(number_of_blocks, sizeof(*peb))) == NULL) {
+		perror("calloc");
 		return -1;
 	}
-	if (GPIO_READ(N_READ_BUSY) == 0) {
-		error_msg("N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+	if (!ubi.volumes) {
+		if ((fd = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+		    ftruncate(fd, (off_t)number_of_blocks * BLOCK_SIZE) < 0) {
+			perror(outfile);
+			return -1;
+		}
+	}
+	snprintf(path, sizeof(path), "%s.map", outfile);
+	if ((map = fopen(path, "w")) == NULL) {
+		perror(path);
 		return -1;
 	}
-
-	if (read_id(id) < 0)
+	if ((badlog = fopen("bad.log", "w+")) == NULL) {
+		perror("fopen bad.log");
 		return -1;
-	print_id(id);
+	}
 	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
 	sleep(3);
 
-	printf("\nStart reading...\n");
-	clock_t start = clock();
-
-
-	for (retry_count = 0, page = first_page_number*2; page < (first_page_number + number_of_pages)*2; page++) {
-
-	  retry_all:
-		page_no = page >> 1;
-
-		//printf("page = %d, n = %d\n",page, n);
-
-		if (page % 2 == 0 && retry_count == 0) {
-			// page_no = page / 2;
-			page_nbr = page_no - first_page_number + 1;
-			percent = (100 * page_nbr) / number_of_pages;
-			block_no = page_no / PAGES_PER_BLOCK;
-			printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\r", page_no, block_no, page_nbr, number_of_pages, percent);
-			fflush(stdout);
+	printf("\nScanning the UBI headers of %d PEBs...\n", number_of_blocks);
+	start = monotonic_ns();
+	prof_start();
+
+	for (i = 0; i < number_of_blocks; i++) {
+		q = &peb[i];
+		page = (first_block_number + i) * PAGES_PER_BLOCK;
+		printf("Scanning block n° %d, %d%%\r", first_block_number + i, 100 * (i + 1) / number_of_blocks);
+		fflush(stdout);
+		for (p = 0; p < 2; p++) {
+			if (read_page_checked(page + p, 0, head[p], PAGE_SIZE, p == 0) < 0) {
+				fprintf(badlog, "Page %d seems to be bad\n", page + p);
+				bad++;
+			}
+			pages_read++;
+			if (fd >= 0 && pwrite(fd, head[p], PAGE_SIZE, (off_t)(i * PAGES_PER_BLOCK + p) * PAGE_SIZE) < 0) {
+				perror(outfile);
+				return -1;
+			}
 		}
-		// else {
-		// 	printf("Reading the page again to ensure correct operation\n");
-		// }
+		prof_lap(PH_FILEIO);
 
-	  retry:
-		read_id(id2);
-		if (memcmp(id, id2, 5) != 0) {
-			printf("\nNAND ID has changed! retrying");
-			goto retry;
-		}
-		send_read_command(page_no);
-		//for (i = 0; i < MAX_WAIT_READ_BUSY; i++) {
-		//	if (GPIO_READ(N_READ_BUSY) == 0)
-		//		break;
-		//}
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			shortpause();
+		if (head[0][DATA_SIZE] != 0xFF || head[1][DATA_SIZE] != 0xFF) {
+			q->state = PEB_BAD;
+			continue;
 		}
-		// if (i == MAX_WAIT_READ_BUSY) {
-		// 	// #ifdef DEBUG
-		// 		printf("N_READ_BUSY was not brought to 0 by NAND in time, retrying\n");
-		// 	// #endif
-		// 	goto retry;
-		// }
-		set_data_direction_in();
-		// for (i = 0; i < MAX_WAIT_READ_BUSY; i++) {
-		// 	if (GPIO_READ(N_READ_BUSY) == 1)
-		// 		break;
-		// }
-		// if (i == MAX_WAIT_READ_BUSY) {
-		// 	// #ifdef DEBUG
-		// 		printf("N_READ_BUSY was not brought to 1 by NAND in time, retrying\n");
-		// 	// #endif
-		// 	goto retry;
-		// }
-		n = PAGE_SIZE*(page & 1);
-		for (i = 0; i < PAGE_SIZE; i++) {
-			GPIO_SET_0(N_READ_ENABLE);
-			shortpause();
-			buf[i + n] = GPIO_DATA8_IN(); //
-			GPIO_SET_1(N_READ_ENABLE);
-			shortpause();
+		if (ubi_erased(head[0], UBI_HDR_SIZE)) {
+			q->state = PEB_ERASED;
+			continue;
 		}
-		if (!n) // read the page again to ensure correct operation, bit 0 in page used for this purpose
-			// printf("RE LOOP    | page = %d, n = %d\n",page, n);
-			// printf("Reading the page n° %d again to ensure correct operation\n", page_no);
+		q->state = PEB_CORRUPT;
+		if (ubi_be32(head[0]) != UBI_EC_MAGIC || !ubi_crc_ok(head[0], 60, head[0] + 60))
+			continue;
+		q->ec = ubi_be32(head[0] + 12);
+		q->vid_offset = ubi_be32(head[0] + 16);
+		q->data_offset = ubi_be32(head[0] + 20);
+		if (q->vid_offset < UBI_HDR_SIZE || q->vid_offset % UBI_HDR_SIZE ||
+		    q->data_offset <= q->vid_offset || q->data_offset % DATA_SIZE ||
+		    q->data_offset >= PAGES_PER_BLOCK * DATA_SIZE)
+			continue;
+		if (q->vid_offset + UBI_HDR_SIZE <= 2 * DATA_SIZE) {
+			memcpy(vid, head[q->vid_offset / DATA_SIZE] + q->vid_offset % DATA_SIZE, UBI_HDR_SIZE);
+		} else {
+			if (read_page_checked(page + q->vid_offset / DATA_SIZE, q->vid_offset % DATA_SIZE, vid, UBI_HDR_SIZE, 0) < 0)
+				continue;
+			pages_read++;
+		}
+		if (ubi_erased(vid, UBI_HDR_SIZE)) {
+			q->state = PEB_FREE;
 			continue;
+		}
+		if (ubi_be32(vid) != UBI_VID_MAGIC || !ubi_crc_ok(vid, 60, vid + 60))
+			continue;
+		q->state = PEB_USED;
+		q->vol_type = vid[5];
+		q->vol_id = ubi_be32(vid + 8);
+		q->lnum = ubi_be32(vid + 12);
+		q->data_size = ubi_be32(vid + 20);
+		q->used_ebs = ubi_be32(vid + 24);
+		q->data_pad = ubi_be32(vid + 28);
+		q->sqnum = (unsigned long long)ubi_be32(vid + 40) << 32 | ubi_be32(vid + 44);
+	}
 
-		if (memcmp(buf, buf + PAGE_SIZE, PAGE_SIZE) != 0) {
-			if (retry_count == 0) printf("\n");
-			if (retry_count < 5) {
-				printf("Page failed to read correctly! retrying\n");
-				retry_count++;
-				page = page & ~1;
-				goto retry_all;
-			}
-			printf("Too many retries. Perhaps bad block?\n");
-			fprintf(badlog, "Page %d seems to be bad\n", page_no);
+	/* older copies of a LEB (interrupted wear levelling or atomic change) */
+	for (i = 0; i < number_of_blocks; i++)
+		for (j = 0; j < number_of_blocks && peb[i].state == PEB_USED; j++)
+			if (peb[j].state == PEB_USED && j != i && peb[j].vol_id == peb[i].vol_id &&
+			    peb[j].lnum == peb[i].lnum && peb[j].sqnum > peb[i].sqnum)
+				peb[i].state = PEB_STALE;
+
+	/* volume table: LEB 0 of the layout volume, LEB 1 is its copy */
+	memset(reserved, 0, sizeof(reserved));
+	for (i = 0; i < number_of_blocks && !vtbl_ok; i++) {
+		q = &peb[i];
+		if (q->state != PEB_USED || q->vol_id != UBI_LAYOUT_VOLUME_ID)
+			continue;
+		page = (first_block_number + i) * PAGES_PER_BLOCK + q->data_offset / DATA_SIZE;
+		for (n = 0; n < (int)sizeof(vtbl); n += DATA_SIZE, page++) {
+			if (read_page_checked(page, 0, buf, DATA_SIZE, n == 0) < 0)
+				break;
+			pages_read++;
+			memcpy(vtbl + n, buf, sizeof(vtbl) - n < DATA_SIZE ? sizeof(vtbl) - n : DATA_SIZE);
 		}
-		if (write_spare) {
-			if (fwrite(buf, PAGE_SIZE, 1, f) != 1) {
-				perror("fwrite");
-				return -1;
+		if (n < (int)sizeof(vtbl))
+			continue;
+		for (vtbl_ok = 1, j = 0; j < UBI_MAX_VOLUMES; j++)
+			if (!ubi_crc_ok(vtbl + j * UBI_VTBL_RECORD_SIZE, 168, vtbl + j * UBI_VTBL_RECORD_SIZE + 168))
+				vtbl_ok = 0;
+	}
+	for (j = 0; j < UBI_MAX_VOLUMES; j++) {
+		const unsigned char *r = vtbl + j * UBI_VTBL_RECORD_SIZE;
+		snprintf(names[j], sizeof(names[j]), "vol%d", j);
+		if (vtbl_ok && (reserved[j] = ubi_be32(r)) > 0 && (n = r[14] << 8 | r[15]) > 0 && n < 128) {
+			memcpy(names[j], r + 16, n);
+			names[j][n] = 0;
+		}
+	}
+	if (!vtbl_ok)
+		printf("\nNo valid volume table, volumes are named by ID\n");
+
+	for (i = 0; i < number_of_blocks; i++) {
+		q = &peb[i];
+		fprintf(map, "PEB %d: ", first_block_number + i);
+		switch (q->state) {
+		case PEB_ERASED: fprintf(map, "erased\n"); break;
+		case PEB_BAD: fprintf(map, "bad\n"); break;
+		case PEB_FREE: fprintf(map, "free, ec %u\n", q->ec); break;
+		case PEB_CORRUPT: fprintf(map, "corrupt headers\n"); break;
+		default:
+			if (q->vol_id == UBI_LAYOUT_VOLUME_ID)
+				fprintf(map, "layout volume LEB %d", q->lnum);
+			else
+				fprintf(map, "volume %d (%s) LEB %d", q->vol_id,
+					q->vol_id >= 0 && q->vol_id < UBI_MAX_VOLUMES ? names[q->vol_id] : "?", q->lnum);
+			fprintf(map, ", ec %u, sqnum %llu%s\n", q->ec, q->sqnum, q->state == PEB_STALE ? ", stale" : "");
+		}
+	}
+	fclose(map);
+
+	if (!ubi.volumes) {
+		/* everything that is not known to be empty; the rest is filled as erased */
+		for (i = 0; i < number_of_blocks; i++) {
+			q = &peb[i];
+			if (q->state != PEB_USED && q->state != PEB_STALE && q->state != PEB_CORRUPT) {
+				memset(buf, 0xFF, PAGE_SIZE);
+				for (p = 2; p < PAGES_PER_BLOCK; p++)
+					if (pwrite(fd, buf, PAGE_SIZE, (off_t)(i * PAGES_PER_BLOCK + p) * PAGE_SIZE) < 0) {
+						perror(outfile);
+						return -1;
+					}
+				continue;
+			}
+			page = (first_block_number + i) * PAGES_PER_BLOCK;
+			printf("Reading block n° %d          \r", first_block_number + i);
+			fflush(stdout);
+			for (p = 2; p < PAGES_PER_BLOCK; p++) {
+				if (read_page_checked(page + p, 0, buf, PAGE_SIZE, p == 2) < 0) {
+					fprintf(badlog, "Page %d seems to be bad\n", page + p);
+					bad++;
+				}
+				prof_lap(PH_VERIFY);
+				if (pwrite(fd, buf, PAGE_SIZE, (off_t)(i * PAGES_PER_BLOCK + p) * PAGE_SIZE) < 0) {
+					perror(outfile);
+					return -1;
+				}
+				prof_lap(PH_FILEIO);
 			}
+			pages_read += PAGES_PER_BLOCK - 2;
+			full_pebs++;
 		}
-		else {
-			if (fwrite(buf, 512 * (PAGE_SIZE / 512), 1, f) != 1) {
-				perror("fwrite");
+		close(fd);
+	} else {
+		for (j = 0; j < UBI_MAX_VOLUMES; j++) {
+			int lebs = reserved[j], leb, data_offset = 2 * DATA_SIZE, data_pad = 0, is_static = 0, size;
+
+			for (i = 0; i < number_of_blocks; i++) {
+				q = &peb[i];
+				if (q->state == PEB_USED && q->vol_id == j) {
+					if (q->lnum >= lebs)
+						lebs = q->lnum + 1;
+					data_offset = q->data_offset;
+					data_pad = q->data_pad;
+					if (q->vol_type == UBI_VID_STATIC) {
+						is_static = 1;
+						lebs = q->used_ebs;
+					}
+				}
+			}
+			if (lebs == 0)
+				continue;
+			snprintf(path, sizeof(path), "%s_%s.img", outfile, names[j]);
+			if ((f = fopen(path, "w")) == NULL) {
+				perror(path);
 				return -1;
 			}
+			printf("\nVolume %d (%s): %d LEBs -> %s\n", j, names[j], lebs, path);
+			for (leb = 0; leb < lebs; leb++) {
+				for (i = 0; i < number_of_blocks; i++)
+					if (peb[i].state == PEB_USED && peb[i].vol_id == j && peb[i].lnum == leb)
+						break;
+				q = i < number_of_blocks ? &peb[i] : NULL;
+				first_page = (q ? q->data_offset : data_offset) / DATA_SIZE;
+				size = (PAGES_PER_BLOCK - first_page) * DATA_SIZE - (q ? q->data_pad : data_pad);
+				if (q && is_static)
+					size = q->data_size;
+				if (q == NULL)
+					printf("LEB %d is not mapped\n", leb);
+				else
+					full_pebs++;
+				printf("Reading LEB %d, %d%%\r", leb, 100 * (leb + 1) / lebs);
+				fflush(stdout);
+				page = (first_block_number + i) * PAGES_PER_BLOCK + first_page;
+				for (n = 0; n < size; n += DATA_SIZE, page++) {
+					memset(buf, 0xFF, DATA_SIZE);
+					if (q) {
+						if (read_page_checked(page, 0, buf, DATA_SIZE, n == 0) < 0) {
+							fprintf(badlog, "Page %d seems to be bad\n", page);
+							bad++;
+						}
+						pages_read++;
+					}
+					prof_lap(PH_VERIFY);
+					if (fwrite(buf, 1, size - n < DATA_SIZE ? size - n : DATA_SIZE, f) == 0) {
+						perror(path);
+						return -1;
+					}
+					prof_lap(PH_FILEIO);
+				}
+			}
+			fclose(f);
 		}
-		retry_count = 0;
 	}
-	fcloseall();
-	clock_t end = clock();
-	printf("\n\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
-
-	//show cursor
-	// printf("\e[?25h");
-	// fflush(stdout) ;
+	fclose(badlog);
+
+	seconds = (monotonic_ns() - start) / 1e9;
+	for (n = i = 0; i < number_of_blocks; i++)
+		n += peb[i].state == PEB_USED;
+	printf("\n\n%d PEBs: %d hold LEBs, %d read past the headers; %d of %d pages read in %f seconds",
+		number_of_blocks, n, full_pebs, pages_read, number_of_blocks * PAGES_PER_BLOCK, seconds);
+	if (pages_read)
+		printf(" (read_full: about %.1f s)", seconds * number_of_blocks * PAGES_PER_BLOCK / pages_read);
+	if (bad)
+		printf(", %d pages could not be read cleanly (see bad.log)", bad);
+	printf("\n");
+	free(peb);
+	link_report();
+	prof_report("ubi_dump");
 	return 0;
 }
 
+/*
+ * oob_scan <block #> <# of blocks> [<spare file>]: factory bad block survey.
+ * The read command carries the column address of the spare area, so only
+ * its first byte (the bad block marker), or all SPARE_SIZE bytes when a
+ * spare file is given, is clocked out of the marker pages of each block
+ * (--bbm-pages=, the first two by default). The second copy is clocked
+ * again from the page register with 05h-E0h and compared, retrying like
+ * read_full. A block is bad when a marker byte is not FFh. The spare file
+ * holds the spare areas of the marker pages, block after block.
+ */
+static INLINE void read_spare(int page, unsigned char *buf, int len)
+{
+	send_read_command(page, DATA_SIZE);
+	prof_lap(PH_CMD);
+	wait_ready();
+	prof_lap(PH_BUSY);
+	set_data_direction_in();
+	clock_out(buf, len);
+	register_page = page;
+	prof_lap(PH_DATA);
+}
 
-/*int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare)
+static int oob_scan(int first_block_number, int number_of_blocks, const char *spare_file)
 {
-	int page, block_no, page_nbr, percent, i;
-	unsigned char buf[PAGE_SIZE], id[5], id2[5];;
-	FILE *f = fopen(outfile, "w+");
-	if (f == NULL) {
-		perror("fopen output file");
-		return -1;
-	}
-	if (GPIO_READ(N_READ_BUSY) == 0) {
-		error_msg("N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
-		return -1;
-	}
+	unsigned char id[5], buf[2][SPARE_SIZE];
+	int block, block_nbr, percent, i, page, marker_page, retry_count, bad = 0, unstable = 0;
+	int len = spare_file ? SPARE_SIZE : 1;
+	unsigned char marker;
+	FILE *f = NULL;
+	long long start;
+	struct bbt_entry { int block, page; unsigned char marker; } *table;
 
 	if (read_id(id) < 0)
 		return -1;
 	print_id(id);
-	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
-	sleep(3);
-
-	printf("\nStart reading...\n\n");
-	clock_t start = clock();
-
-
-	for (page = first_page_number; page < first_page_number + number_of_pages; page++) {
-
-		// printf("page = %d, n = %d\n",page, n);
+	link_start(id);
+	if ((table = (bbt_entry *)calloc(number_of_blocks, sizeof(*table))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	if (spare_file) {
+		f = strcmp(spare_file, "-") == 0 ? fdopen(out.fd, "w") : fopen(spare_file, "w");
+		if (f == NULL) {
+			perror("fopen spare file");
+			return -1;
+		}
+	}
 
-		// page_nbr = page - first_page_number + 1;
-		// percent = (100 * page_nbr) / number_of_pages;
-		// block_no = page / 64;
-		// printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\n", page, block_no, page_nbr, number_of_pages, percent);
-		printf("\nReading page n° %d\n", page);
+	printf("\nScanning %d pages of each block...\n", bbm.n);
+	start = monotonic_ns();
+	prof_start();
 
-		send_read_command(page);
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
-		}
-		set_data_direction_in();
-		for (i = 0; i < PAGE_SIZE; i++) {
-			GPIO_SET_0(N_READ_ENABLE);
-			shortpause();
-			buf[i] = GPIO_DATA8_IN(); //
-			shortpause();
-			GPIO_SET_1(N_READ_ENABLE);
-			shortpause();
-		}
-		if (write_spare) {
-			if (fwrite(buf, PAGE_SIZE, 1, f) != 1) {
-				perror("fwrite");
-				return -1;
+	for (block = first_block_number; block < first_block_number + number_of_blocks; block++) {
+		block_nbr = block - first_block_number + 1;
+		percent = (100 * block_nbr) / number_of_blocks;
+		printf("Scanning block n° %d (block %d of %d), %d%%\r", block, block_nbr, number_of_blocks, percent);
+		fflush(stdout);
+
+		marker = 0xFF;
+		marker_page = -1;
+		for (i = 0; i < bbm.n; i++) {
+			page = block * PAGES_PER_BLOCK + bbm.page[i];
+			for (retry_count = 0; ; retry_count++) {
+				prof_lap(PH_OTHER);
+				link_check(i == 0 && retry_count == 0, retry_count > 0);
+				prof_lap(PH_IDCHECK);
+				read_spare(page, buf[0], len);
+				change_read_column(DATA_SIZE);
+				clock_out(buf[1], len);
+				prof_lap(PH_DATA);
+				if (memcmp(buf[0], buf[1], len) == 0)
+					break;
+				if (retry_count == 5) {
+					printf("\nPage %d: spare area reads differ, too many retries\n", page);
+					unstable++;
+					break;
+				}
 			}
-		}
-		else {
-			if (fwrite(buf, 512 * (PAGE_SIZE / 512), 1, f) != 1) {
+			prof_lap(PH_VERIFY);
+			if (f != NULL && fwrite(buf[0], SPARE_SIZE, 1, f) != 1) {
 				perror("fwrite");
 				return -1;
 			}
+			prof_lap(PH_FILEIO);
+			if (buf[0][0] != 0xFF && marker_page < 0) {
+				marker = buf[0][0];
+				marker_page = bbm.page[i];
+			}
+		}
+		if (marker_page >= 0) {
+			table[bad].block = block;
+			table[bad].page = marker_page;
+			table[bad].marker = marker;
+			bad++;
 		}
 	}
-	fcloseall();
-	clock_t end = clock();
-	printf("\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	if (f != NULL)
+		fclose(f);
+
+	printf("\nScan done in %f seconds: %d of %d blocks bad", (monotonic_ns() - start) / 1e9, bad, number_of_blocks);
+	if (unstable)
+		printf(", %d spare areas did not read the same twice", unstable);
+	printf("\n");
+	if (bad)
+		printf("\nBad block table:\n");
+	for (i = 0; i < bad; i++)
+		printf("block %5d at 0x%08lx: marker %02x in page %d\n",
+			table[i].block, (long)table[i].block * BLOCK_SIZE, table[i].marker, table[i].page);
+	free(table);
+	link_report();
+	prof_report("oob_scan");
+	return 0;
 }
-*/
-static INLINE int write_pages(int first_page_number, int number_of_pages, char *infile)
-{
-	int page, block_no, page_nbr, percent, retry_count;
-	unsigned char buf[PAGE_SIZE], id[5], id2[5];;
 
-	if (read_id(id) < 0)
-		return -1;
-	print_id(id);
-	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
-	sleep(3);
+static long long bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-	printf("\nStart writing...\n");
-	clock_t start = clock();
+/* one CSV line: ns/op, and throughput when an op moves bytes or whole pages */
+static void bench_report(const char *timing, const char *op, long n, long long ns, long bytes_per_op, int pages_per_op)
+{
+	double secs = ns / 1e9;
 
+	printf("bench,%s,%s,%ld,%.1f,%.3f,%.1f\n", timing, op, n, (double)ns / n,
+		bytes_per_op ? bytes_per_op * n / secs / 1e6 : 0.0,
+		pages_per_op ? (double)pages_per_op * n / secs : 0.0);
+	fflush(stdout);
+}
 
-	FILE *f = fopen(infile, "rb");
-	if (f == NULL) {
-		perror("fopen input file");
+/*
+ * Times the bus primitives and whole page sequences for every <delay> in the
+ * comma separated list, e.g. "1,10,50" or "onfi0,onfi3". Program and erase only touch
+ * scratch_block, and are skipped when it is < 0.
+ */
+static int bench(const char *delays, int iterations, int scratch_block)
+{
+	unsigned char buf[PAGE_SIZE];
+	char d[256];
+	long n, page_iterations;
+	long long t, ns;
+	const char *p;
+	volatile int sink = 0;
+
+	if (iterations <= 0) {
+		printf("# of iterations must be > 0\n");
 		return -1;
 	}
+	page_iterations = iterations / PAGE_SIZE > 4 ? iterations / PAGE_SIZE : 4;
+	memset(buf, 0x5A, PAGE_SIZE);
 
-	// printf("first_page_number = %d\n", first_page_number);
-	// printf("number of pages = %d\n", number_of_pages);
-
-
-	for (retry_count = 0, page = first_page_number; page < first_page_number + number_of_pages; page++) {
-
-	  retry_all:
+	printf("bench,delay,op,iterations,ns_per_op,mb_per_s,pages_per_s\n");
+	for (p = delays; *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : p + strlen(p)) {
+		snprintf(d, sizeof(d), "%.*s", (int)strcspn(p, ","), p);
+		if (timing_parse(d) < 0)
+			return -1;
 
-		if (retry_count == 0) {
-			// page_no = page / 2;
-			page_nbr = page - first_page_number + 1;
-			percent = (100 * page_nbr) / number_of_pages;
-			block_no = page / PAGES_PER_BLOCK;
-			printf("Writing page n° %d in block n° %d (page %d of %d), %d%%\r", page, block_no, page_nbr, number_of_pages, percent);
-			fflush(stdout);
+		set_data_direction_in();
+		t = bench_now();
+		for (n = 0; n < iterations; n++)
+			sink += GPIO_DATA8_IN();
+		bench_report(d, "data8_in", n, bench_now() - t, 1, 0);
+
+		set_data_direction_out();
+		t = bench_now();
+		for (n = 0; n < iterations; n++)
+			GPIO_DATA8_OUT(n);
+		bench_report(d, "data8_out", n, bench_now() - t, 1, 0);
+
+		t = bench_now();
+		for (n = 0; n < iterations; n++) {
+			set_data_direction_in();
+			set_data_direction_out();
 		}
+		bench_report(d, "direction_switch", n * 2, bench_now() - t, 0, 0);
+
+		// only the command cycles are timed, the part has to finish tR before the next one
+		for (n = 0, ns = 0; n < iterations / 16; n++) {
+			t = bench_now();
+			send_read_command(0);
+			ns += bench_now() - t;
+			wait_ready();
+		}
+		bench_report(d, "send_read_command", n, ns, 0, 0);
+
+		t = bench_now();
+		for (n = 0; n < iterations / 16; n++)
+			sink += read_status();
+		bench_report(d, "read_status", n, bench_now() - t, 0, 0);
+
+		t = bench_now();
+		for (n = 0; n < page_iterations; n++) {
+			send_read_command(n % PAGES_PER_BLOCK);
+			wait_ready();
+			set_data_direction_in();
+			clock_out(buf, PAGE_SIZE);
+		}
+		bench_report(d, "page_read", n, bench_now() - t, PAGE_SIZE, 1);
 
-		fseek(f, page * PAGE_SIZE, SEEK_SET);
-		fread(buf, PAGE_SIZE, 1, f);
-
-		// printf("\nwriting page n°%d\n", page);
+		if (scratch_block < 0)
+			continue;
 
-	  retry:
-		read_id(id2);
-		if (memcmp(id, id2, 5) != 0) {
-			printf("\nNAND ID has changed! retrying");
-			goto retry;
+		t = bench_now();
+		send_eraseblock_command(scratch_block * PAGES_PER_BLOCK);
+		wait_ready();
+		sink += read_status();
+		bench_report(d, "block_erase", 1, bench_now() - t, 0, 0);
+
+		memset(buf, 0x5A, PAGE_SIZE);
+		t = bench_now();
+		for (n = 0; n < PAGES_PER_BLOCK; n++) {
+			send_write_command(scratch_block * PAGES_PER_BLOCK + n, buf);
+			wait_ready();
+			sink += read_status();
 		}
+		bench_report(d, "page_program", n, bench_now() - t, PAGE_SIZE, 1);
 
-		send_write_command(page, buf);
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
-		}
-		// read_status();
-		if (read_status()) {
-			if (retry_count == 0) printf("\n");
-			if (retry_count < 5) {
-				printf("Failed to write page correctly! retrying\n");
-				retry_count++;
-				goto retry_all;
-			}
-			printf("Too many retries. Perhaps bad block?\n");
-			// retry_count = 0;
-		}
-		retry_count = 0;
+		send_eraseblock_command(scratch_block * PAGES_PER_BLOCK);
+		wait_ready();
+		sink += read_status();
 	}
+	(void)sink;
+	return 0;
+}
 
+/*
+ * Reads the sample pages with the current timing and counts the bytes
+ * that differ from ref.
+ */
+static long calibrate_pass(int first_page, int pages, const unsigned char *ref, unsigned char *buf)
+{
+	long bad = 0;
+	int p, i;
 
+	for (p = 0; p < pages; p++) {
+		read_page(first_page + p, buf);
+		for (i = 0; i < PAGE_SIZE; i++)
+			bad += buf[i] != ref[(long)p * PAGE_SIZE + i];
+	}
+	return bad;
+}
 
+static long calibrate_try(int first_page, int pages, int passes, const unsigned char *ref, unsigned char *buf)
+{
+	long bad = 0;
+	int i;
 
-
-	fcloseall();
-	clock_t end = clock();
-	printf("\nWrite done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
-	return 0;
+	for (i = 0; i < passes && !bad; i++)
+		bad += calibrate_pass(first_page, pages, ref, buf);
+	return bad;
 }
 
-static INLINE int erase_blocks(int first_block_number, int number_of_blocks)
+/*
+ * Finds the fastest bus timing that reads the sample pages back without a
+ * single mismatch over <passes> passes, and writes it as a timing profile.
+ * The reference copy is read with the <delay> given on the command line,
+ * which should be a known good, conservative setting. Then ONFI mode 0 is
+ * scaled down step by step, and from the fastest clean step each
+ * read-path parameter is halved on its own while it stays clean. The
+ * result gets a 50% margin. tADL only matters for programming, which a
+ * read can't check, so it is never set below the fastest ONFI mode.
+ */
+static int calibrate(int first_page, int pages, int passes, const char *profile)
 {
-	int block, block_nbr, percent, retry_count;
-	unsigned char id[5], id2[5];
+	static const int scales[] = { 400, 300, 200, 150, 100, 75, 50, 35, 25, 15, 10, 5, 0 };
+	static const int tunable[] = { T_REA, T_RC, T_WP, T_WH, T_CLS, T_ALS, T_WHR, T_WB };
+	unsigned char id[5], buf[PAGE_SIZE * 2], *ref;
+	unsigned ns[T_COUNT], best[T_COUNT];
+	int i, t, p, retry, found = 0;
+	long bad;
+	char comment[160];
 
 	if (read_id(id) < 0)
 		return -1;
 	print_id(id);
-	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
-	sleep(3);
+	if ((ref = (unsigned char *)malloc((size_t)pages * PAGE_SIZE)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
 
-	printf("\nStart erasing...\n");
-	clock_t start = clock();
+	printf("\nReading %d reference pages...\n", pages);
+	for (p = 0; p < pages; p++) {
+		for (retry = 0; ; retry++) {
+			read_page(first_page + p, buf);
+			read_page(first_page + p, buf + PAGE_SIZE);
+			if (memcmp(buf, buf + PAGE_SIZE, PAGE_SIZE) == 0)
+				break;
+			if (retry == 5) {
+				error_msg("reference pages don't read back consistently, use a slower <delay>");
+				free(ref);
+				return -1;
+			}
+		}
+		memcpy(ref + (long)p * PAGE_SIZE, buf, PAGE_SIZE);
+	}
 
-	for (retry_count = 0, block = first_block_number; block < (first_block_number + number_of_blocks); block++) {
+	printf("\nscale  mismatched bytes\n");
+	for (i = 0; i < (int)(sizeof(scales) / sizeof(scales[0])); i++) {
+		for (t = 0; t < T_COUNT; t++)
+			ns[t] = (onfi_timing_modes[0][t] * scales[i] + 99) / 100;
+		timing_set_ns(ns);
+		bad = calibrate_try(first_page, pages, passes, ref, buf);
+		printf("%4d%%  %ld\n", scales[i], bad);
+		if (bad)
+			break;
+		memcpy(best, ns, sizeof(best));
+		found = 1;
+	}
+	if (!found) {
+		error_msg("no timing read the sample pages back cleanly");
+		free(ref);
+		return -1;
+	}
 
-	  retry_all:
-			
-		block_nbr = block - first_block_number + 1;
-		percent = (100 * block_nbr) / number_of_blocks;
+	printf("\nparameter   ns  mismatched bytes\n");
+	for (i = 0; i < (int)(sizeof(tunable) / sizeof(tunable[0])); i++) {
+		t = tunable[i];
+		while (best[t] > 0) {
+			memcpy(ns, best, sizeof(ns));
+			ns[t] = best[t] / 2;
+			if (timing_check(ns) != NULL)
+				break;
+			timing_set_ns(ns);
+			bad = calibrate_try(first_page, pages, passes, ref, buf);
+			printf("%-9s %4u  %ld\n", timing_names[t], ns[t], bad);
+			if (bad)
+				break;
+			best[t] = ns[t];
+		}
+	}
 
-		if (retry_count == 0) {
-			printf("Erasing block n° %d at adress 0x%02X (block %d of %d), %d%%\r", block, block * BLOCK_SIZE, block_nbr, number_of_blocks, percent);
-			fflush(stdout);
-			// printf("Block address : %d (0x%02X)\n", block * BLOCK_SIZE, block * BLOCK_SIZE);
+	for (t = 0; t < T_COUNT; t++)
+		best[t] = best[t] + (best[t] + 1) / 2;
+	if (best[T_ADL] < onfi_timing_modes[5][T_ADL])
+		best[T_ADL] = onfi_timing_modes[5][T_ADL];
+	timing_set_ns(best);
+	bad = calibrate_try(first_page, pages, passes, ref, buf);
+	free(ref);
+	if (bad) {
+		printf("\nfinal timing with margin still shows %ld mismatched bytes, not saving\n", bad);
+		return -1;
+	}
+
+	printf("\n");
+	timing_print();
+	snprintf(comment, sizeof(comment), "calibrated on pages %d-%d, %d passes, 50%% margin, ID %02X %02X %02X %02X %02X",
+		first_page, first_page + pages - 1, passes, id[0], id[1], id[2], id[3], id[4]);
+	if (timing_save(profile, comment) < 0)
+		return -1;
+	printf("timing profile written to %s, pass it as <delay> to use it\n", profile);
+	return 0;
+}
+
+#define MERGE_MAX	31	// dumps, so a bit-sliced count fits 5 planes
+
+static INLINE long vec_popcount(vec128 v)
+{
+	return __builtin_popcountll(v[0]) + __builtin_popcountll(v[1]);
+}
+
+/* bit-sliced count == k (eq) and count > k (gt), nbits planes */
+static INLINE void vec_compare(const vec128 *count, int nbits, int k, vec128 *eq, vec128 *gt)
+{
+	vec128 e = ~(vec128){ 0, 0 }, g = { 0, 0 };
+	int b;
+
+	for (b = nbits - 1; b >= 0; b--) {
+		if ((k >> b) & 1) {
+			e &= count[b];
+		} else {
+			g |= e & count[b];
+			e &= ~count[b];
 		}
+	}
+	*eq = e;
+	*gt = g;
+}
 
-	  retry:
-		read_id(id2);
-		if (memcmp(id, id2, 5) != 0) {
-			printf("\nNAND ID has changed! retrying");
-			goto retry;
+/*
+ * merge <output> <dump> <dump> [...]: bitwise majority of several read_full
+ * dumps, without touching the GPIO. The files are mmap()ed MERGE_WINDOW
+ * blocks at a time (a block is 33 * 4096 bytes, so every window starts on
+ * a page boundary), which keeps several multi-GB dumps inside a 32 bit
+ * address space, and walked a page at a time in 16 byte vectors. For each
+ * of the 128 bit positions of a vector the number of dumps with that bit
+ * set is kept bit-sliced (count[b] holds bit b of all 128 counters), so
+ * adding a dump is a short ripple of vector ANDs/XORs and the majority is
+ * one compare against n/2.
+ * Pages whose dumps disagree are listed with the number of differing bits
+ * and of ties (even n, the first dump's bit is kept).
+ */
+#define MERGE_WINDOW	256	// blocks
+
+static int merge(const char *output, int n, char **inputs)
+{
+	const unsigned char *in[MERGE_MAX];
+	unsigned char *out;
+	int fds[MERGE_MAX];
+	struct stat st;
+	off_t len = -1;
+	size_t off, wlen;
+	long page, pages, first, wpages, differ, tied, bad_pages = 0, total_differ = 0, total_tied = 0;
+	int i, b, fd, nbits;
+	vec128 count[5], v, carry, t, any, all, lead, eq, gt, zero = { 0, 0 };
+	long long start = monotonic_ns();
+
+	if (n < 2 || n > MERGE_MAX) {
+		printf("merge needs 2 to %d dumps\n", MERGE_MAX);
+		return -1;
+	}
+	if (n == 2)
+		printf("with 2 dumps every difference is a tie, 3 or more are needed for a majority\n");
+	for (nbits = 0; (1 << nbits) <= n; nbits++)
+		;
+
+	for (i = 0; i < n; i++) {
+		if ((fds[i] = open(inputs[i], O_RDONLY)) < 0 || fstat(fds[i], &st) < 0) {
+			perror(inputs[i]);
+			return -1;
+		}
+		if (st.st_size < PAGE_SIZE) {
+			printf("%s: %lld bytes, not even one %d byte page\n", inputs[i], (long long)st.st_size, PAGE_SIZE);
+			return -1;
 		}
+		if (st.st_size % PAGE_SIZE)
+			printf("%s: %lld bytes are not a whole number of %d byte pages\n", inputs[i], (long long)st.st_size, PAGE_SIZE);
+		if (len < 0 || st.st_size < len)
+			len = st.st_size;
+	}
+	pages = len / PAGE_SIZE;
 
-		send_eraseblock_command(block * PAGES_PER_BLOCK);
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			// printf("Busy\n");
-			//shortpause();
+	if ((fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, (off_t)pages * PAGE_SIZE) < 0) {
+		perror(output);
+		return -1;
+	}
+
+	for (first = 0; first < pages; first += wpages) {
+		wpages = pages - first < MERGE_WINDOW * PAGES_PER_BLOCK ? pages - first : MERGE_WINDOW * PAGES_PER_BLOCK;
+		wlen = (size_t)wpages * PAGE_SIZE;
+		for (i = 0; i < n; i++) {
+			in[i] = (const unsigned char *)mmap(NULL, wlen, PROT_READ, MAP_SHARED, fds[i], (off_t)first * PAGE_SIZE);
+			if (in[i] == MAP_FAILED) {
+				perror(inputs[i]);
+				return -1;
+			}
+			madvise((void *)in[i], wlen, MADV_SEQUENTIAL);
+		}
+		out = (unsigned char *)mmap(NULL, wlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)first * PAGE_SIZE);
+		if (out == MAP_FAILED) {
+			perror(output);
+			return -1;
 		}
 
-		if (read_status()) {
-			if (retry_count == 0) printf("\n");
-			if (retry_count < 5) {
-				printf("Failed to erase block correctly! retrying\n");
-				retry_count++;
-				goto retry_all;
+		for (page = first; page < first + wpages; page++) {
+			differ = tied = 0;
+			for (off = (page - first) * PAGE_SIZE; off < (size_t)(page - first + 1) * PAGE_SIZE; off += sizeof(vec128)) {
+				for (b = 0; b < nbits; b++)
+					count[b] = zero;
+				memcpy(&lead, in[0] + off, sizeof(vec128));
+				any = zero;
+				all = ~zero;
+				for (i = 0; i < n; i++) {
+					memcpy(&v, in[i] + off, sizeof(vec128));
+					any |= v;
+					all &= v;
+					for (carry = v, b = 0; b < nbits; b++) {
+						t = count[b] & carry;
+						count[b] ^= carry;
+						carry = t;
+					}
+				}
+				vec_compare(count, nbits, n / 2, &eq, &gt);
+				if (n & 1)
+					eq = zero; // n/2 ones is a minority then
+				v = gt | (eq & lead);
+				memcpy(out + off, &v, sizeof(vec128));
+				differ += vec_popcount(any & ~all);
+				tied += vec_popcount(eq);
+			}
+			if (differ) {
+				printf("page %ld (block %ld): %ld bits differ, %ld tied\n", page, page / PAGES_PER_BLOCK, differ, tied);
+				bad_pages++;
+				total_differ += differ;
+				total_tied += tied;
 			}
-			printf("Too many retries. Perhaps bad block?\n");
-			// retry_count = 0;
 		}
-		retry_count = 0;
+
+		for (i = 0; i < n; i++)
+			munmap((void *)in[i], wlen);
+		munmap(out, wlen);
 	}
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+	close(fd);
 
-	clock_t end = clock();
-	printf("\nErasing done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
-	return 0;
+	printf("merged %ld pages from %d dumps in %.2f s: %ld pages had differing bits (%ld bits, %ld tied)\n",
+		pages, n, (monotonic_ns() - start) / 1e9, bad_pages, total_differ, total_tied);
+	return total_tied ? 1 : 0;
+}
+
+/*
+ * export <container> [<page #> <# of pages>] <output>: writes a --container
+ * dump (or a range of it) back out in the read_full layout, erased pages as
+ * FFh, through the same output engine as read_full. The container is
+ * mmap()ed, so a range costs only the pages in it. Every page is checked
+ * against its CRC32; mismatches are listed and make the exit status 1.
+ */
+static int export_dump(const char *container, const char *output, int first, int pages)
+{
+	const unsigned char *map;
+	const dump_header *h;
+	const dump_page *index, *p;
+	dump_trailer t;
+	unsigned char erased[PAGE_SIZE];
+	struct stat st;
+	long counts[4] = { 0, 0, 0, 0 }, crc_errors = 0;
+	int fd, page, i;
+
+	if (strcmp(output, "-") == 0 && out_stream() < 0)
+		return -1;
+	if ((fd = open(container, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(container);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(dump_header) + sizeof(dump_trailer)) {
+		printf("%s: too short for a container\n", container);
+		return -1;
+	}
+	map = (const unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap container");
+		return -1;
+	}
+	h = (const dump_header *)map;
+	memcpy(&t, map + st.st_size - sizeof(t), sizeof(t));
+	if (memcmp(h->magic, DUMP_MAGIC, 8) != 0 || memcmp(t.magic, DUMP_INDEX_MAGIC, 8) != 0) {
+		printf("%s: not a container\n", container);
+		return -1;
+	}
+	if (h->version != DUMP_VERSION || h->page_size != PAGE_SIZE || t.pages != h->pages ||
+	    t.index_offset + (uint64_t)t.pages * sizeof(dump_page) + sizeof(t) != (uint64_t)st.st_size) {
+		printf("%s: unsupported version %u, page size %u or a damaged index\n", container, h->version, h->page_size);
+		return -1;
+	}
+	index = (const dump_page *)(map + t.index_offset);
+	crc32_init();
+	if (crc32_buf((const unsigned char *)index, t.pages * sizeof(dump_page)) != t.index_crc) {
+		printf("%s: index CRC mismatch\n", container);
+		return -1;
+	}
+
+	if (first < 0) {
+		first = h->first_page;
+		pages = h->pages;
+	}
+	if (pages <= 0 || (uint32_t)first < h->first_page || (uint64_t)first + pages > (uint64_t)h->first_page + h->pages) {
+		printf("%s holds pages %u to %u\n", container, h->first_page, h->first_page + h->pages - 1);
+		return -1;
+	}
+	printf("%s: ID %02x %02x %02x %02x %02x, pages %u to %u, ",
+		container, h->id[0], h->id[1], h->id[2], h->id[3], h->id[4], h->first_page, h->first_page + h->pages - 1);
+	if (h->timing_uniform)
+		printf("read with a delay of %u\n", h->delay);
+	else
+		printf("read with tWP=%u tRC=%u ns\n", h->timing_ns[T_WP], h->timing_ns[T_RC]);
+
+	memset(erased, 0xFF, sizeof(erased));
+	if (out_open(output, (size_t)pages * PAGE_SIZE, 0) < 0)
+		return -1;
+	for (page = first; page < first + pages; page++) {
+		p = &index[page - h->first_page];
+		for (i = 0; i < 4; i++)
+			if (p->flags & (1 << i))
+				counts[i]++;
+		if (p->flags & DUMP_ERASED) {
+			if (out_write(erased, PAGE_SIZE) < 0)
+				return -1;
+			continue;
+		}
+		if (p->offset < sizeof(dump_header) || p->offset + PAGE_SIZE > t.index_offset) {
+			printf("page %d: payload offset %llu out of range\n", page, (unsigned long long)p->offset);
+			return -1;
+		}
+		if (crc32_buf(map + p->offset, PAGE_SIZE) != p->crc) {
+			printf("page %d (block %d): CRC mismatch\n", page, page / PAGES_PER_BLOCK);
+			crc_errors++;
+		}
+		if (out_write(map + p->offset, PAGE_SIZE) < 0)
+			return -1;
+	}
+	if (out_close() < 0)
+		return -1;
+	munmap((void *)map, st.st_size);
+	printf("exported %d pages: %ld erased, %ld retried, %ld voted, %ld bad, %ld CRC mismatches\n",
+		pages, counts[0], counts[2], counts[3], counts[1], crc_errors);
+	return crc_errors ? 1 : 0;
 }
@@ -0,0 +1,191 @@
+#!/bin/sh
+#
+# Simulator regression for rpi-tsop48-nand: builds the -DNAND_SIM flasher
+# and the offline tool, then reads, writes and converts a random image
+# through every mode and fault knob, stops and resumes a write and a read,
+# and compares each result with cmp.
+# The simulator stops with an error on a command the part would not take,
+# or on pages programmed out of order, so those fail the run as well.
+#
+#   sh sim-check.sh
+#
+
+CXX=${CXX:-g++}
+SRC=$(cd "$(dirname "$0")" && pwd)
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+PAGES=2048                      # 32 blocks
+P=2112
+fails=0
+
+$CXX -O2 -Wall -DNAND_SIM "$SRC/rpi-tsop48-nand.cpp" -o "$T/nandsim" -lpthread || exit 1
+$CXX -O2 -Wall "$SRC/rpi-tsop48-nand-tool.cpp" -o "$T/tool" || exit 1
+cd "$T" || exit 1
+head -c $((PAGES * P)) /dev/urandom > ref.img
+
+# flip <image> <page> <byte> <bit>: a cell that reads back flipped
+flip() {
+	off=$(($2 * P + $3))
+	b=$(od -An -tu1 -j $off -N1 "$1")
+	printf "$(printf '\\%03o' $(($b ^ (1 << $4))))" | dd of="$1" bs=1 seek=$off conv=notrunc 2>/dev/null
+}
+
+# pages <first> <count> of a read_full image
+pages() {
+	dd if="$1" bs=$P skip="$2" count="$3" 2>/dev/null
+}
+
+# check <name> <expected file> <actual file>
+check() {
+	if cmp -s "$2" "$3"; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		fails=$((fails + 1))
+	fi
+}
+
+# sim <image> <options and command...>, output and status go to log
+sim() {
+	img=$1
+	shift
+	./nandsim --sim-image="$img" --sim-pages=$PAGES "$@" > log 2>&1 || {
+		echo "     exit status $?: $(grep '^sim:' log || tail -n 1 log)"
+		fails=$((fails + 1))
+	}
+}
+
+# stop <journal> <options and command...>: runs on sim.img and is killed
+# once the journal holds its first done mark
+stop() {
+	j=$1
+	shift
+	./nandsim --sim-image=sim.img --sim-pages=$PAGES "$@" > log 2>&1 &
+	pid=$!
+	i=0
+	while ! grep -q '^done' "$j" 2>/dev/null && [ $i -lt 300 ]; do
+		sleep 0.1
+		i=$((i + 1))
+	done
+	kill -9 $pid
+	wait $pid 2>/dev/null
+	grep -q '^done' "$j" 2>/dev/null || { echo "FAIL $* was not stopped partway"; fails=$((fails + 1)); }
+}
+
+pages ref.img 0 1024 > ref-1024.bin
+
+# reads, clean and with faults on the bus
+for opts in "" "--cache" "--pipeline" "--cache --pipeline" "--sim-planes=2 --planes" \
+    "--verify=ecc:hamming" "--sim-flip=30000" "--sim-flip=30000 --pipeline" \
+    "--sim-flip=30000 --cache --pipeline" "--sim-glitch=200" "--adaptive --sim-flip=30000"; do
+	cp ref.img sim.img
+	rm -f out.bin
+	sim sim.img $opts 1 read_full 0 1024 out.bin
+	check "read_full $opts" ref-1024.bin out.bin
+done
+
+# --verify=ecc on an image with a valid spare area ECC: page 3 has a flipped
+# cell the ECC accepts from one read, page 700 too many for that in a sector
+for opts in "hamming" "bch4" "hamming --pipeline"; do
+	cp ref.img sim.img
+	sim sim.img --sim-ecc=${opts%% *} 1 read_id
+	flip sim.img 3 100 2
+	flip sim.img 700 600 0
+	flip sim.img 700 601 3
+	flip sim.img 700 602 5
+	flip sim.img 700 603 7
+	rm -f out.bin
+	sim sim.img --verify=ecc:$opts 1 read_full 0 1024 out.bin
+	pages sim.img 0 1024 > expect.bin
+	check "read_full --verify=ecc:$opts on valid ECC" expect.bin out.bin
+	grep -q "ECC verify: 1023 pages from a single read (1 bit flips accepted), 1 read again" log ||
+		{ echo "FAIL --verify=ecc:$opts: $(grep 'ECC verify' log)"; fails=$((fails + 1)); }
+done
+
+cp ref.img sim.img
+sim sim.img 1 read_data 0 1024 out.bin
+"$T/tool" strip ref-1024.bin ref-main.bin > /dev/null
+check "read_data" ref-main.bin out.bin
+
+sim sim.img 1 read_range_full 5000 300000 out.bin
+dd if=ref.img bs=1 skip=5000 count=300000 2>/dev/null > expect.bin
+check "read_range_full" expect.bin out.bin
+
+./nandsim --sim-image=sim.img --sim-pages=$PAGES --pipeline 1 read_full 0 1024 - > out.bin 2> log
+check "read_full --pipeline to stdout" ref-1024.bin out.bin
+
+# writes, including an unaligned two-plane write
+for opts in "" "--cache" "--sim-planes=2 --planes" "--sim-planes=2 --planes --cache"; do
+	cp ref.img sim.img
+	sim sim.img $opts 1 erase_blocks 0 16
+	sim sim.img $opts 1 write_full 10 900 ref.img
+	pages sim.img 10 900 > out.bin
+	pages ref.img 10 900 > expect.bin
+	check "write_full $opts" expect.bin out.bin
+	pages sim.img 0 10 > out.bin
+	head -c $((10 * P)) /dev/zero | tr '\0' '\377' > expect.bin
+	check "write_full $opts leaves pages before the range erased" expect.bin out.bin
+done
+
+# failing programs: a page given up on is listed in bad.log and left erased,
+# and --cache gives up on a page a later page of its block has followed
+for opts in "--sim-prog-fail=50" "--sim-prog-fail=50 --cache"; do
+	cp ref.img sim.img
+	sim sim.img 1 erase_blocks 0 16
+	sim sim.img $opts 1 write_full 10 900 ref.img
+	pages ref.img 10 900 > expect.bin
+	for n in $(sed -n 's/^Page \([0-9]*\) seems to be bad$/\1/p' bad.log); do
+		head -c $P /dev/zero | tr '\0' '\377' |
+			dd of=expect.bin bs=$P seek=$((n - 10)) conv=notrunc 2>/dev/null
+	done
+	pages sim.img 10 900 > out.bin
+	check "write_full $opts ($(grep -c . bad.log) bad)" expect.bin out.bin
+done
+grep -q "not retried" log || { echo "FAIL --cache did not give up on a page"; fails=$((fails + 1)); }
+
+# --resume after a run killed partway, and a run that cannot keep a journal
+cp ref.img sim.img
+sim sim.img 1 erase_blocks 0 16
+stop ref.img.journal --sim-tprog=4000 1 write_full 10 900 ref.img
+sim sim.img --resume 1 write_full 10 900 ref.img
+pages sim.img 10 900 > out.bin
+pages ref.img 10 900 > expect.bin
+check "write_full --resume" expect.bin out.bin
+rm -f out.bin
+stop out.bin.journal --sim-tr=3000 1 read_full 0 1024 out.bin
+sim sim.img --resume 1 read_full 0 1024 out.bin
+pages sim.img 0 1024 > expect.bin
+check "read_full --resume" expect.bin out.bin
+rm -f out.bin
+mkdir out.bin.journal
+sim sim.img 1 read_full 0 1024 out.bin
+check "read_full without a journal" expect.bin out.bin
+rmdir out.bin.journal
+
+# container, export and merge
+cp ref.img sim.img
+sim sim.img --container 1 read_full 0 1024 dump.bin
+./nandsim export dump.bin out.bin > log 2>&1
+check "export" ref-1024.bin out.bin
+./nandsim export dump.bin 100 50 out.bin > log 2>&1
+pages ref.img 100 50 > expect.bin
+check "export range" expect.bin out.bin
+for i in 1 2 3; do
+	sim sim.img --sim-flip=$((20000 + i)) --cache 1 read_full 0 1024 noisy$i.bin
+done
+./nandsim merge out.bin noisy1.bin noisy2.bin noisy3.bin > log 2>&1
+check "merge" ref-1024.bin out.bin
+
+# offline tool
+"$T/tool" strip ref-1024.bin main.bin oob.bin > /dev/null
+"$T/tool" insert main.bin out.bin oob.bin > /dev/null
+check "tool strip + insert" ref-1024.bin out.bin
+"$T/tool" extract ref-1024.bin 3 4 out.bin > /dev/null
+pages ref.img 192 256 > expect.bin
+check "tool extract" expect.bin out.bin
+
+if [ $fails -ne 0 ]; then
+	echo "$fails checks failed"
+	exit 1
+fi
+echo "all checks passed"